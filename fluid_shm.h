@@ -0,0 +1,146 @@
+// shared memory frame ring published by realfluid --shm NAME.
+// one header page, then FLUID_SHM_SLOTS float32 height fields. every slot has
+// a seqlock: odd while the solver writes it, even once it is complete. readers
+// map the object read-only and look at frames in place, then check the sequence
+// to see whether the frame was overwritten while they used it.
+// header only, readers need no SDL:  gcc tool.c -o tool -lrt
+#ifndef FLUID_SHM_H
+#define FLUID_SHM_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define FLUID_SHM_MAGIC 0x4D48534C  // "LSHM"
+#define FLUID_SHM_VERSION 1
+#define FLUID_SHM_NAME "/realfluid"
+#define FLUID_SHM_SLOTS 4
+#define FLUID_SHM_ALIGN 4096
+
+typedef struct {
+    _Atomic uint64_t seq;       // odd while being written
+    uint64_t step;              // solver step the field belongs to
+    uint64_t frame;             // publish counter, slot = frame % FLUID_SHM_SLOTS
+    uint64_t reserved;
+} FluidShmSlot;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t slots;
+    uint32_t reserved;
+    uint64_t slot_offset;       // first field, from the start of the mapping
+    uint64_t slot_bytes;        // stride between fields
+    uint64_t size;
+    _Atomic uint64_t published; // frames published so far, newest is published - 1
+    FluidShmSlot slot[FLUID_SHM_SLOTS];
+} FluidShmHeader;
+
+typedef struct {
+    const FluidShmHeader *header;
+    const uint8_t *base;
+    size_t size;
+} FluidShmReader;
+
+// a frame as handed to a reader, only valid until fluid_shm_read_end says so
+typedef struct {
+    const float *field;
+    uint64_t step;
+    uint64_t frame;
+    int slot;
+    uint64_t seq;
+} FluidShmFrame;
+
+static inline size_t fluid_shm_align(size_t n) {
+    return (n + FLUID_SHM_ALIGN - 1) & ~(size_t)(FLUID_SHM_ALIGN - 1);
+}
+
+static inline void fluid_shm_layout(FluidShmHeader *header, uint32_t width, uint32_t height) {
+    memset(header, 0, sizeof(*header));
+    header->magic = FLUID_SHM_MAGIC;
+    header->version = FLUID_SHM_VERSION;
+    header->width = width;
+    header->height = height;
+    header->slots = FLUID_SHM_SLOTS;
+    header->slot_offset = fluid_shm_align(sizeof(FluidShmHeader));
+    header->slot_bytes = fluid_shm_align((size_t)width * height * sizeof(float));
+    header->size = header->slot_offset + header->slot_bytes * FLUID_SHM_SLOTS;
+}
+
+static inline float *fluid_shm_field(const FluidShmHeader *header, int slot) {
+    return (float *)((uint8_t *)header + header->slot_offset + header->slot_bytes * slot);
+}
+
+// returns 0 if the object does not exist (yet) or is not a frame ring
+static inline int fluid_shm_open_reader(FluidShmReader *r, const char *name) {
+    memset(r, 0, sizeof(*r));
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) return 0;
+
+    struct stat st;
+    void *base = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(FluidShmHeader)) {
+        base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (base == MAP_FAILED) return 0;
+
+    // the offsets have to be the ones this header would lay out for the stated size,
+    // a stale or foreign object could otherwise point the fields past the mapping
+    const FluidShmHeader *header = base;
+    FluidShmHeader expect;
+    fluid_shm_layout(&expect, header->width, header->height);
+    if (header->magic != FLUID_SHM_MAGIC || header->version != FLUID_SHM_VERSION ||
+        header->slots != FLUID_SHM_SLOTS || header->width == 0 || header->height == 0 ||
+        header->slot_offset != expect.slot_offset || header->slot_bytes != expect.slot_bytes ||
+        header->size != expect.size || header->size > (uint64_t)st.st_size) {
+        munmap(base, st.st_size);
+        return 0;
+    }
+    r->header = header;
+    r->base = base;
+    r->size = st.st_size;
+    return 1;
+}
+
+static inline void fluid_shm_close_reader(FluidShmReader *r) {
+    if (r->base) munmap((void *)r->base, r->size);
+    memset(r, 0, sizeof(*r));
+}
+
+static inline uint64_t fluid_shm_published(const FluidShmReader *r) {
+    return atomic_load_explicit(&((FluidShmHeader *)r->header)->published, memory_order_acquire);
+}
+
+// newest complete frame, 0 if none has been published or the solver is mid-write
+static inline int fluid_shm_read_begin(const FluidShmReader *r, FluidShmFrame *frame) {
+    FluidShmHeader *header = (FluidShmHeader *)r->header;
+    uint64_t published = atomic_load_explicit(&header->published, memory_order_acquire);
+    if (published == 0) return 0;
+
+    int slot = (int)((published - 1) % FLUID_SHM_SLOTS);
+    uint64_t seq = atomic_load_explicit(&header->slot[slot].seq, memory_order_acquire);
+    if (seq & 1) return 0;
+
+    frame->field = fluid_shm_field(header, slot);
+    frame->step = header->slot[slot].step;
+    frame->frame = header->slot[slot].frame;
+    frame->slot = slot;
+    frame->seq = seq;
+    return 1;
+}
+
+// 1 if nothing touched the slot since read_begin, so whatever was read is consistent
+static inline int fluid_shm_read_end(const FluidShmReader *r, const FluidShmFrame *frame) {
+    FluidShmHeader *header = (FluidShmHeader *)r->header;
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&header->slot[frame->slot].seq, memory_order_relaxed) == frame->seq;
+}
+
+#endif
@@ -3,220 +3,6237 @@
 #include <math.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <poll.h>
+#include <errno.h>
+#include <assert.h>
+#include "fluid_shm.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
+#ifndef WIDTH
 #define WIDTH 1200
+#endif
+#ifndef HEIGHT
 #define HEIGHT 800
+#endif
+#ifndef CELL_SIZE
 #define CELL_SIZE 1  // water dot size
+#endif
+// the grid defaults to one cell per CELL_SIZE window pixels, but can be set on
+// its own (-DGRID_WIDTH=4096 -DGRID_HEIGHT=4096) to simulate finer than the window
+#ifndef GRID_WIDTH
 #define GRID_WIDTH (WIDTH / CELL_SIZE)
+#endif
+#ifndef GRID_HEIGHT
 #define GRID_HEIGHT (HEIGHT / CELL_SIZE)
+#endif
+#define GRID_CELLS ((size_t)GRID_WIDTH * GRID_HEIGHT)
+
+// a grid larger than the window is box filtered DISPLAY_SCALE times each way
+// before colorizing, the GPU stretches whatever size comes out over the window
+#ifndef DISPLAY_SCALE
+#define DISPLAY_SCALE_X ((GRID_WIDTH + WIDTH - 1) / WIDTH)
+#define DISPLAY_SCALE_Y ((GRID_HEIGHT + HEIGHT - 1) / HEIGHT)
+#define DISPLAY_SCALE (DISPLAY_SCALE_X > DISPLAY_SCALE_Y ? DISPLAY_SCALE_X : DISPLAY_SCALE_Y)
+#endif
+#define DISPLAY_WIDTH (GRID_WIDTH / DISPLAY_SCALE)
+#define DISPLAY_HEIGHT (GRID_HEIGHT / DISPLAY_SCALE)
+#define DISPLAY_CELLS ((size_t)DISPLAY_WIDTH * DISPLAY_HEIGHT)
+
+// window pixel to grid cell
+#define GRID_X(px) ((int)((int64_t)(px) * GRID_WIDTH / WIDTH))
+#define GRID_Y(py) ((int)((int64_t)(py) * GRID_HEIGHT / HEIGHT))
+
+// cell storage, pick with -DFLUID_STORAGE=...
+#define FLUID_FLOAT32 0
+#define FLUID_INT16 1   // Q format fixed point, half the memory traffic
+#define FLUID_FP16 2    // half floats, math still in float32
+#define FLUID_BF16 3    // bfloat16, float32 range with 8 bit mantissa
+#define FLUID_FLOAT64 4 // double everywhere, for long offline runs
+#define FLUID_KAHAN 5   // float32 plus a compensation term per cell
+
+#ifndef FLUID_STORAGE
+#define FLUID_STORAGE FLUID_FLOAT32
+#endif
+#define CELL_IS_FLOAT (FLUID_STORAGE != FLUID_INT16)
+
+#if FLUID_STORAGE == FLUID_INT16
+#ifndef FIXED_FRAC_BITS
+#define FIXED_FRAC_BITS 10  // Q5.10, heights in +-32 at 1/1024 steps
+#endif
+typedef int16_t cell_t;
+#define CELL_NAME "int16"
+#define CELL_LOAD(c) ((c) * (1.0f / (1 << FIXED_FRAC_BITS)))
+#define CELL_STORE(f) fixed_from_float(f)
+
+static inline int16_t fixed_saturate(int32_t v) {
+    return v > 32767 ? 32767 : (v < -32768 ? -32768 : v);
+}
+
+static inline int16_t fixed_from_float(float f) {
+    float v = f * (1 << FIXED_FRAC_BITS);
+    v = fminf(fmaxf(v, -32768.0f), 32767.0f);
+    return (int16_t)lrintf(v);
+}
+#elif FLUID_STORAGE == FLUID_FP16
+// stored as ieee half bits, rows are widened in bulk (f16c when built with -mf16c)
+typedef uint16_t cell_t;
+#define CELL_NAME "fp16"
+#define CELL_LOAD(c) half_to_float(c)
+#define CELL_STORE(f) float_to_half(f)
+
+static inline float half_to_float(uint16_t h) {
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1F;
+    uint32_t mant = h & 0x3FF;
+    uint32_t bits;
+
+    if (exp == 0x1F) {
+        bits = sign | 0x7F800000 | (mant << 13);
+    } else if (exp != 0) {
+        bits = sign | ((exp + 112) << 23) | (mant << 13);
+    } else {
+        // subnormal, value is mant * 2^-24
+        float f = mant * (1.0f / 16777216.0f);
+        return sign ? -f : f;
+    }
+
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+static inline uint16_t float_to_half(float f) {
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    uint16_t sign = (bits >> 16) & 0x8000;
+    float a = fabsf(f);
+
+    // the payload would round into the exponent below, keep it a quiet nan
+    if (f != f) return 0x7E00;
+    if (a >= 65520.0f) return sign | 0x7C00;
+    if (a < 6.103515625e-05f) {
+        // subnormal range, round to a multiple of 2^-24
+        return sign | (uint16_t)lrintf(a * 16777216.0f);
+    }
+
+    // rebias the exponent and round the mantissa to nearest even
+    uint32_t u = bits & 0x7FFFFFFF;
+    u += 0x0FFF + ((u >> 13) & 1);
+    return sign | (uint16_t)((u - (112u << 23)) >> 13);
+}
+#elif FLUID_STORAGE == FLUID_BF16
+// top half of a float32, round to nearest even on store (avx512-bf16 when available)
+typedef uint16_t cell_t;
+#define CELL_NAME "bf16"
+#define CELL_LOAD(c) bf16_to_float(c)
+#define CELL_STORE(f) float_to_bf16(f)
+
+static inline float bf16_to_float(uint16_t h) {
+    uint32_t bits = (uint32_t)h << 16;
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+static inline uint16_t float_to_bf16(float f) {
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    // rounding could carry a nan payload into inf
+    if (f != f) return 0x7FC0;
+    bits += 0x7FFF + ((bits >> 16) & 1);
+    return (uint16_t)(bits >> 16);
+}
+#elif FLUID_STORAGE == FLUID_FLOAT64
+typedef double cell_t;
+typedef double calc_t;
+#define CELL_NAME "float64"
+#define CELL_LOAD(c) (c)
+#define CELL_STORE(f) (f)
+#elif FLUID_STORAGE == FLUID_KAHAN
+// hi part lives in current/previous, the rounding residue in current_lo/previous_lo.
+// needs strict float semantics, don't build this one with -ffast-math
+typedef float cell_t;
+#define CELL_NAME "float32+kahan"
+#define CELL_LOAD(c) (c)
+#define CELL_STORE(f) (f)
+#else
+typedef float cell_t;
+#define CELL_NAME "float32"
+#define CELL_LOAD(c) (c)
+#define CELL_STORE(f) (f)
+#endif
+
+#if FLUID_STORAGE != FLUID_FLOAT64
+typedef float calc_t;
+#endif
+
+// laplacian stencil, pick with -DFLUID_STENCIL=...
+#define STENCIL_5 5     // the plain cross
+#define STENCIL_13 13   // fourth order in space and time, two cells of reach
+
+#ifndef FLUID_STENCIL
+#define FLUID_STENCIL STENCIL_5
+#endif
+#if FLUID_STENCIL != STENCIL_5 && FLUID_STENCIL != STENCIL_13
+#error "FLUID_STENCIL must be 5 or 13"
+#endif
+#if FLUID_STENCIL == STENCIL_13 && FLUID_STORAGE != FLUID_FLOAT32 && FLUID_STORAGE != FLUID_FLOAT64
+#error "the 13 point stencil needs float32 or float64 storage"
+#endif
+
+// rows per band, the unit of work handed to a thread
+#ifndef BAND_ROWS
+#define BAND_ROWS 32
+#endif
+
+// threads the band loop may run on, and the one running now
+static inline int band_threads(void) {
+#ifdef _OPENMP
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+static inline int band_thread(void) {
+#ifdef _OPENMP
+    return omp_get_thread_num();
+#else
+    return 0;
+#endif
+}
+
+static inline int band_team(void) {
+#ifdef _OPENMP
+    return omp_get_num_threads();
+#else
+    return 1;
+#endif
+}
+
+#if FLUID_STORAGE == FLUID_FP16 || FLUID_STORAGE == FLUID_BF16
+#define CELL_WIDENED 1
+#if defined(__F16C__) || defined(__AVX512BF16__)
+#include <immintrin.h>
+#endif
+
+// widen a row of narrow cells to float32
+static void load_row(float *dst, const cell_t *src, int n) {
+    int i = 0;
+#if FLUID_STORAGE == FLUID_FP16 && defined(__F16C__)
+    for (; i + 8 <= n; i += 8) {
+        __m128i h = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(h));
+    }
+#endif
+    for (; i < n; i++) dst[i] = CELL_LOAD(src[i]);
+}
+
+// narrow a row of float32 back to storage
+static void store_row(cell_t *dst, const float *src, int n) {
+    int i = 0;
+#if FLUID_STORAGE == FLUID_FP16 && defined(__F16C__)
+    for (; i + 8 <= n; i += 8) {
+        __m128i h = _mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT);
+        _mm_storeu_si128((__m128i *)(dst + i), h);
+    }
+#elif FLUID_STORAGE == FLUID_BF16 && defined(__AVX512BF16__) && defined(__AVX512VL__)
+    for (; i + 8 <= n; i += 8) {
+        __m128bh h = _mm256_cvtneps_pbh(_mm256_loadu_ps(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i), (__m128i)h);
+    }
+#endif
+    for (; i < n; i++) dst[i] = CELL_STORE(src[i]);
+}
+#endif
+
+// persistent sources/sinks, kept as structure-of-arrays so one pass covers all of them
+typedef enum {
+    EMITTER_OSCILLATOR,
+    EMITTER_PADDLE,
+    EMITTER_DRAIN
+} EmitterKind;
 
 typedef struct {
-    float *current;
-    float *previous;
+    int count;
+    int capacity;
+    unsigned long ticks;
+    int64_t *cell;      // grid index
+    uint8_t *kind;
+    float *gain;        // multiplies the cell each step, < 1 for drains
+    float *amplitude;
+    float *re;          // phasor, rotated once per step instead of calling sinf
+    float *im;
+    float *cos_w;
+    float *sin_w;
+    float *drive;       // scratch for the vector pass
+} EmitterSet;
+
+// gauges sampled bilinearly at the end of every step into a preallocated ring.
+// the arrays are kept sorted by grid index so a gather walks memory forward
+typedef struct {
+    int count;
+    int capacity;
+    float *x;           // registration order, for export
+    float *y;
+    int64_t *base;      // top-left cell, sorted
+    float *fx;          // bilinear weights, sorted like base
+    float *fy;
+    int *slot;          // registration order -> sorted column
+    int frames;         // ring capacity, 0 until start_probes
+    float *ring;        // frames x count, sorted columns
+    uint64_t *ring_step;
+    uint64_t recorded;  // steps sampled so far, the oldest are overwritten once full
+} ProbeSet;
+
+// solid cells (walls, piers, islands), one bit per cell in rows of 64 bit words.
+// solid cells are held at zero and their water neighbours see them as mirrors.
+// rows[y] is set when y or a row within the stencil's reach has any, the
+// kernels skip the rest
+typedef struct {
+    int words;          // per row
+    uint64_t *bits;
+    uint8_t *rows;
+    int64_t solid;      // cells set
+} ObstacleMask;
+
+// per cell maps are a byte per cell. each row is cut into tiles of 64 cells
+// that record their value when they are uniform, so the kernels can treat them
+// as constants
+#define MAP_MIXED 0xFFFF
+#define MAP_TILE 64
+
+// per cell wave speed, kept as the kernel coefficient (c dt/dx)^2 in steps of
+// 1/512. SPEED_BASE is the 0.25 the kernels use
+#define SPEED_BASE 128
+
+typedef struct {
+    int tiles;          // per row
+    uint8_t *q;
+    uint16_t *tile;     // the tile's value, MAP_MIXED if it varies
+    uint8_t *rows;      // some tile is off SPEED_BASE
+    float mur[256];     // open edge coefficient for each value
+} SpeedMap;
+
+// what the per step damping multiplies. height pulls the whole surface toward
+// zero, velocity only takes energy out of the motion and leaves a level alone
+typedef enum {
+    DAMPING_HEIGHT,
+    DAMPING_VELOCITY,
+    DAMPING_MODELS
+} DampingModel;
+
+// per cell damping on top of fluid->damping, for shallows and absorbing zones.
+// 0 is no extra damping
+#define DAMPING_LOSS 0.05f
+
+typedef struct {
+    int tiles;          // per row
+    uint8_t *q;
+    uint16_t *tile;     // the tile's value, MAP_MIXED if it varies
+    uint8_t *rows;      // some tile is off 0
+    float loss;         // at 255, factor[v] is 1 - loss * v / 255
+    float factor[256];  // multiplies fluid->damping for each value, factor[0] is 1
+} DampingMap;
+
+// field statistics gathered by the update kernel itself, one entry per row band
+#define GRID_BANDS ((GRID_HEIGHT - 2 + BAND_ROWS - 1) / BAND_ROWS)
+
+typedef struct {
+    double energy;      // sum of squared heights
+    float peak;         // max |height|
+    int64_t active;     // cells with |height| above the threshold, on STATS_COUNT steps
+    int x0, y0, x1, y1; // inclusive bounding box of the active cells, x1 < x0 when none
+} BandStats;
+
+// quiet steps before the window settles. headless runs only settle when
+// asked, so benchmarks keep stepping
+#define IDLE_AFTER 120
+
+// steps between the energy sums the idle check looks at, when nothing else
+// wants stats every step
+#define IDLE_CHECK 8
+
+// what a step gathers. energy and peak ride along in the kernels, the boxes
+// add a scan in from both ends of rows over the threshold, and the count is
+// a second pass over every row, so it is only taken on steps that print
+typedef enum {
+    STATS_NONE,
+    STATS_ENERGY,
+    STATS_BOXES,
+    STATS_COUNT
+} StatsLevel;
+
+typedef struct {
+    float threshold;
+    double idle_energy; // below this for idle_after steps the grid settles
+    int idle_after;     // 0 never settles
+    int boxes;          // the renderer redraws from the boxes, gather them every step
+    int count_every;    // steps between active counts, 0 never
+    StatsLevel level;   // what the last step gathered
+    uint64_t step;      // step the totals describe
+    BandStats total;
+    BandStats band[GRID_BANDS];
+    BandStats view[GRID_BANDS]; // active boxes of fluid->current, the field on screen
+} FieldStats;
+
+// checkpoint file: a header page, then page aligned arrays so a restore can mmap them in place
+#define CHECKPOINT_MAGIC 0x4B434C46  // "FLCK"
+#define CHECKPOINT_VERSION 3
+#define CHECKPOINT_ALIGN 4096
+#define CHECKPOINT_PATH "fluid.ckpt"
+#define CHECKPOINT_DELTA 1   // codec: grids delta coded back to back, not mappable
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t storage;
+    uint32_t cell_bytes;
+    float damping;
+    uint32_t emitter_count;
+    uint64_t step;
+    uint64_t emitter_ticks;
+    uint64_t current_offset;
+    uint64_t previous_offset;
+    uint64_t current_lo_offset;   // kahan residues, 0 when the storage has none
+    uint64_t previous_lo_offset;
+    uint64_t emitter_offset;
+    uint64_t file_size;
+    uint32_t codec;               // 0 raw page aligned arrays
+    uint32_t damping_model;       // DampingModel, 0 in files from before it was saved
+    uint64_t current_bytes;       // encoded sizes when codec is set
+    uint64_t previous_bytes;
+    uint64_t current_lo_bytes;
+    uint64_t previous_lo_bytes;
+} CheckpointHeader;
+
+// what happens at the edges. the kernels only step the interior, so by default
+// the edge cells stay at zero and act as walls that reflect every wave
+typedef enum {
+    BOUNDARY_WALL,
+    BOUNDARY_OPEN,      // first order engquist-majda on the edge cells
+    BOUNDARY_SPONGE,    // open edges behind a band of graded damping
+    BOUNDARY_PERIODIC,  // the edge ring mirrors the opposite side, the interior wraps around
+    BOUNDARY_MODES
+} BoundaryMode;
+
+#define SPONGE_MAX 64
+#define SPONGE_WIDTH 32
+#define SPONGE_STRENGTH 0.01f
+
+typedef struct {
+    int mode;
+    int width;                  // sponge cells inside each edge, edge included
+    float strength;             // share of each step's change taken off next to the edge
+    float factor[SPONGE_MAX];   // per step multiplier by distance from the edge
+} Boundary;
+
+typedef struct {
+    cell_t *current;
+    cell_t *previous;
     float damping; 
+    int damping_model;
+    Boundary boundary;
+    EmitterSet emitters;
+#if FLUID_STORAGE == FLUID_KAHAN
+    float *current_lo;
+    float *previous_lo;
+#endif
+    uint64_t step;
+    void *mapping;        // set when the buffers live in an mmap'd checkpoint
+    size_t mapping_size;
+    CheckpointHeader *backing;  // file-backed grid, header kept in sync with the buffers
+    ProbeSet *probes;     // sampled after every step, not owned
+    const ObstacleMask *obstacles;  // not owned
+    const SpeedMap *speed;          // not owned
+    const DampingMap *damping_map;  // not owned
+    FieldStats *stats;    // filled in by every step when set, not owned
+#ifdef CELL_WIDENED
+    float *windows;       // a rolling window of four float32 rows per band thread
+    int window_count;
+#endif
+    int touch_x0, touch_y0, touch_x1, touch_y1;  // injected since the last step, x1 < x0 when none
+    int quiet_steps;      // consecutive steps under stats->idle_energy
+    int idle;             // settled at exact zero, steps do nothing until the next injection
 } FluidGrid;
 
+// heights at or below this colorize exactly like flat water
+#define DIRTY_THRESHOLD 0.004f
+
 typedef struct {
     SDL_Texture *texture;
     uint32_t *pixels;
     int pitch;
+    int drawn;                  // pixels hold a complete frame
+    BandStats shown[GRID_BANDS];    // active boxes (in grid cells) of the frame in pixels
+    SDL_Rect dirty[GRID_BANDS];     // texture pixels changed since the last upload
+    int dirty_count;
 } FluidRenderer;
 
-// mouse x,y positionss
-static int prev_mouse_x = -1;
-static int prev_mouse_y = -1;
+// storm workload, seeded so benchmark runs repeat exactly
+#define STORM_MAX_BOATS 64
+
+typedef struct {
+    uint64_t seed;
+    float rain_rate;       // mean drops per frame (poisson)
+    float rain_intensity;
+    int boats;
+    float boat_speed;      // cells per frame
+    float boat_intensity;
+    int wave_makers;       // 0..4, one per boundary edge
+    int wave_period;       // frames per wave maker cycle
+    float wave_intensity;
+} StormConfig;
+
+typedef struct {
+    StormConfig config;
+    uint64_t rng;
+    float boat_x[STORM_MAX_BOATS];
+    float boat_y[STORM_MAX_BOATS];
+    float boat_dx[STORM_MAX_BOATS];
+    float boat_dy[STORM_MAX_BOATS];
+    unsigned long frame;
+    unsigned long drops;
+} Storm;
+
+typedef struct {
+    int headless;
+    int frames;
+    int storm_enabled;
+    StormConfig storm;
+    int oscillators;
+    float damping;
+    int drift_steps;
+    const char *checkpoint_path;
+    int checkpoint_every;
+    const char *restore_path;
+    const char *backing_path;
+    const char *series_path;
+    int series_every;
+    int series_bits;
+    int series_codec;
+    float series_error;
+    int series_chunk;
+    const char *series_dump;
+    int checkpoint_compress;
+    int codec_bench;
+    int stencil_bench;
+    const char *export_path;
+    int export_format;
+    int export_every;
+    int export_fps;
+    const char *shm_name;
+    const char *serve_addr;
+    int serve_scale;
+    float serve_error;
+    const char *view_addr;
+    int ensemble_steps;
+    float sweep_damping_lo;
+    float sweep_damping_hi;
+    int sweep_damping_count;
+    const char *sweep_sizes;
+    const char *sweep_patterns;
+    int sweep_seeds;
+    const char *ensemble_out;
+    int ensemble_layout;
+    const char *probe_path;
+    int probe_grid_x;
+    int probe_grid_y;
+    const char *probe_out;
+    int probe_frames;
+    int stats_every;
+    float stats_threshold;
+    int idle_after;
+    float idle_energy;
+    int smooth;         // linear filtering when the texture is stretched to the window
+    int boundary;
+    int sponge_width;
+    float sponge_strength;
+    const char *obstacle_path;
+    const char *depth_path;
+    float depth_scale;
+    int damping_model;
+    int damping_given;  // --damping / --damping-model, else a resumed backing file keeps its own
+    int damping_model_given;
+    const char *damping_map_path;
+    float damping_map_loss;
+} FluidOptions;
+
+// injections mark the cells they write, so a renderer knows what to redraw
+static inline void touch_cells(FluidGrid *fluid, int x0, int y0, int x1, int y1) {
+    if (x0 < fluid->touch_x0) fluid->touch_x0 = x0;
+    if (y0 < fluid->touch_y0) fluid->touch_y0 = y0;
+    if (x1 > fluid->touch_x1) fluid->touch_x1 = x1;
+    if (y1 > fluid->touch_y1) fluid->touch_y1 = y1;
+}
+
+static inline void touch_all(FluidGrid *fluid) {
+    fluid->touch_x0 = fluid->touch_y0 = 0;
+    fluid->touch_x1 = GRID_WIDTH - 1;
+    fluid->touch_y1 = GRID_HEIGHT - 1;
+}
+
+// mouse x,y positionss
+static int prev_mouse_x = -1;
+static int prev_mouse_y = -1;
+
+// the widened kernel's scratch rows, once per grid instead of once per band.
+// without them no band could step, so running on would only freeze the field
+static void alloc_windows(FluidGrid *fluid) {
+#ifdef CELL_WIDENED
+    fluid->window_count = band_threads();
+    fluid->windows = malloc((size_t)fluid->window_count * 4 * GRID_WIDTH * sizeof(float));
+    if (!fluid->windows) {
+        printf("Failed to allocate %d widening windows\n", fluid->window_count);
+        exit(1);
+    }
+#else
+    (void)fluid;
+#endif
+}
+
+void init_fluid(FluidGrid *fluid) {
+    fluid->current = calloc(GRID_CELLS, sizeof(cell_t));
+    fluid->previous = calloc(GRID_CELLS, sizeof(cell_t));
+    fluid->damping = 0.99f;
+    fluid->damping_model = DAMPING_HEIGHT;
+    memset(&fluid->emitters, 0, sizeof(fluid->emitters));
+#if FLUID_STORAGE == FLUID_KAHAN
+    fluid->current_lo = calloc(GRID_CELLS, sizeof(float));
+    fluid->previous_lo = calloc(GRID_CELLS, sizeof(float));
+#endif
+    fluid->step = 0;
+    fluid->mapping = NULL;
+    fluid->mapping_size = 0;
+    fluid->backing = NULL;
+    fluid->probes = NULL;
+    fluid->obstacles = NULL;
+    fluid->speed = NULL;
+    fluid->damping_map = NULL;
+    fluid->stats = NULL;
+    fluid->quiet_steps = 0;
+    fluid->idle = 0;
+    touch_all(fluid);
+    memset(&fluid->boundary, 0, sizeof(fluid->boundary));
+    alloc_windows(fluid);
+}
+
+// zero the outer ring of a buffer
+static void clear_edges(cell_t *g) {
+    memset(g, 0, GRID_WIDTH * sizeof(cell_t));
+    memset(g + (size_t)(GRID_HEIGHT - 1) * GRID_WIDTH, 0, GRID_WIDTH * sizeof(cell_t));
+    for (int y = 1; y < GRID_HEIGHT - 1; y++) {
+        g[(size_t)y * GRID_WIDTH] = 0;
+        g[(size_t)y * GRID_WIDTH + GRID_WIDTH - 1] = 0;
+    }
+}
+
+// quadratic ramp from no damping at the inner side of the sponge up to
+// strength next to the edge, gentle enough that the ramp itself barely reflects
+void set_boundary(FluidGrid *fluid, int mode, int width, float strength) {
+    Boundary *b = &fluid->boundary;
+
+    // the other modes leave values in the edge cells, walls have to start from zero
+    if (mode == BOUNDARY_WALL && b->mode != BOUNDARY_WALL && fluid->current) {
+        clear_edges(fluid->current);
+        clear_edges(fluid->previous);
+#if FLUID_STORAGE == FLUID_KAHAN
+        clear_edges(fluid->current_lo);
+        clear_edges(fluid->previous_lo);
+#endif
+        touch_all(fluid);
+    }
+    if (width < 1) width = 1;
+    if (width > SPONGE_MAX) width = SPONGE_MAX;
+    if (width > GRID_WIDTH / 2) width = GRID_WIDTH / 2;
+    if (width > GRID_HEIGHT / 2) width = GRID_HEIGHT / 2;
+    b->mode = mode;
+    b->width = width;
+    b->strength = strength;
+    for (int d = 0; d < width; d++) {
+        float r = (float)(width - d) / width;
+        b->factor[d] = 1.0f - strength * r * r;
+    }
+}
+
+void free_emitters(EmitterSet *set) {
+    free(set->cell);
+    free(set->kind);
+    free(set->gain);
+    free(set->amplitude);
+    free(set->re);
+    free(set->im);
+    free(set->cos_w);
+    free(set->sin_w);
+    free(set->drive);
+    memset(set, 0, sizeof(*set));
+}
+
+void free_fluid(FluidGrid *fluid) {
+    if (fluid->mapping) {
+        munmap(fluid->mapping, fluid->mapping_size);
+        fluid->mapping = NULL;
+        fluid->backing = NULL;
+    } else {
+        free(fluid->current);
+        free(fluid->previous);
+#if FLUID_STORAGE == FLUID_KAHAN
+        free(fluid->current_lo);
+        free(fluid->previous_lo);
+#endif
+    }
+    free_emitters(&fluid->emitters);
+#ifdef CELL_WIDENED
+    free(fluid->windows);
+    fluid->windows = NULL;
+    fluid->window_count = 0;
+#endif
+}
+
+// still water again, in the buffers the grid already has (heap or backing file).
+// maps, boundary, damping and stats stay attached
+void reset_fluid(FluidGrid *fluid) {
+    memset(fluid->current, 0, GRID_CELLS * sizeof(cell_t));
+    memset(fluid->previous, 0, GRID_CELLS * sizeof(cell_t));
+#if FLUID_STORAGE == FLUID_KAHAN
+    memset(fluid->current_lo, 0, GRID_CELLS * sizeof(float));
+    memset(fluid->previous_lo, 0, GRID_CELLS * sizeof(float));
+#endif
+    free_emitters(&fluid->emitters);
+    fluid->step = 0;
+    fluid->quiet_steps = 0;
+    fluid->idle = 0;
+    touch_all(fluid);
+}
+
+int init_fluid_renderer(SDL_Renderer *renderer, FluidRenderer *frenderer, int smooth) {
+    // the texture is display sized and stretched to the window on the GPU
+    SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, smooth ? "linear" : "nearest");
+    frenderer->texture = SDL_CreateTexture(renderer, 
+        SDL_PIXELFORMAT_ARGB8888, 
+        SDL_TEXTUREACCESS_STREAMING, 
+        DISPLAY_WIDTH, DISPLAY_HEIGHT);
+    
+    if (!frenderer->texture) {
+        printf("Failed to create texture: %s\n", SDL_GetError());
+        return 0;
+    }
+    
+    frenderer->pixels = malloc(DISPLAY_CELLS * sizeof(uint32_t));
+    if (!frenderer->pixels) {
+        printf("Failed to allocate pixel buffer\n");
+        return 0;
+    }
+    
+    frenderer->pitch = DISPLAY_WIDTH * sizeof(uint32_t);
+    return 1;
+}
+
+void free_fluid_renderer(FluidRenderer *frenderer) {
+    if (frenderer->texture) SDL_DestroyTexture(frenderer->texture);
+    if (frenderer->pixels) free(frenderer->pixels);
+}
+
+int reserve_emitters(EmitterSet *set, int capacity) {
+    if (capacity <= set->capacity) return 1;
+
+    int n = set->capacity ? set->capacity : 64;
+    while (n < capacity) n *= 2;
+
+    int64_t *cell = realloc(set->cell, n * sizeof(int64_t));
+    if (cell) set->cell = cell;
+    uint8_t *kind = realloc(set->kind, n * sizeof(uint8_t));
+    if (kind) set->kind = kind;
+    float **arrays[] = { &set->gain, &set->amplitude, &set->re, &set->im,
+                         &set->cos_w, &set->sin_w, &set->drive };
+    int ok = cell && kind;
+    for (int i = 0; i < 7; i++) {
+        float *p = realloc(*arrays[i], n * sizeof(float));
+        if (p) *arrays[i] = p;
+        else ok = 0;
+    }
+
+    if (!ok) {
+        printf("Failed to allocate emitters\n");
+        return 0;
+    }
+    set->capacity = n;
+    return 1;
+}
+
+int add_emitter(FluidGrid *fluid, int x, int y, EmitterKind kind,
+                float amplitude, float period, float phase, float gain) {
+    EmitterSet *set = &fluid->emitters;
+    if (x < 1 || x >= GRID_WIDTH - 1 || y < 1 || y >= GRID_HEIGHT - 1) return -1;
+    if (!reserve_emitters(set, set->count + 1)) return -1;
+
+    int i = set->count++;
+    fluid->idle = 0;
+    float w = period > 0.0f ? 6.2831853f / period : 0.0f;
+    set->cell[i] = (int64_t)y * GRID_WIDTH + x;
+    set->kind[i] = kind;
+    set->gain[i] = gain;
+    set->amplitude[i] = amplitude;
+    set->re[i] = cosf(phase);
+    set->im[i] = sinf(phase);
+    set->cos_w[i] = cosf(w);
+    set->sin_w[i] = sinf(w);
+    return i;
+}
+
+// point source oscillating with period in steps
+void add_oscillator(FluidGrid *fluid, int x, int y, float amplitude, float period) {
+    add_emitter(fluid, x, y, EMITTER_OSCILLATOR, amplitude, period, 0.0f, 1.0f);
+}
+
+// line wave maker, rasterized once into in-phase point sources
+void add_paddle(FluidGrid *fluid, int x1, int y1, int x2, int y2, float amplitude, float period) {
+    int dx = abs(x2 - x1);
+    int dy = abs(y2 - y1);
+    int steps = dx > dy ? dx : dy;
+
+    for (int i = 0; i <= steps; i++) {
+        float t = steps ? (float)i / steps : 0.0f;
+        int cx = (int)(x1 + (x2 - x1) * t + 0.5f);
+        int cy = (int)(y1 + (y2 - y1) * t + 0.5f);
+        add_emitter(fluid, cx, cy, EMITTER_PADDLE, amplitude, period, 0.0f, 1.0f);
+    }
+}
+
+// sink, pulls the surface toward flat inside the radius
+void add_drain(FluidGrid *fluid, int x, int y, int radius, float strength) {
+    for (int dy = -radius; dy <= radius; dy++) {
+        for (int dx = -radius; dx <= radius; dx++) {
+            float dist = sqrtf(dx*dx + dy*dy);
+            if (dist <= radius) {
+                float falloff = 1.0f - dist / (radius + 1);
+                add_emitter(fluid, x + dx, y + dy, EMITTER_DRAIN,
+                            0.0f, 0.0f, 0.0f, 1.0f - strength * falloff);
+            }
+        }
+    }
+}
+
+void clear_emitters(FluidGrid *fluid) {
+    fluid->emitters.count = 0;
+}
+
+void apply_emitters(FluidGrid *fluid) {
+    EmitterSet *set = &fluid->emitters;
+    int n = set->count;
+    if (n == 0) return;
+
+    float *restrict re = set->re;
+    float *restrict im = set->im;
+    const float *restrict cw = set->cos_w;
+    const float *restrict sw = set->sin_w;
+    const float *restrict amp = set->amplitude;
+    float *restrict drive = set->drive;
+
+    // rotate every phasor, branch free so it vectorizes
+    for (int i = 0; i < n; i++) {
+        float r = re[i] * cw[i] - im[i] * sw[i];
+        float m = re[i] * sw[i] + im[i] * cw[i];
+        re[i] = r;
+        im[i] = m;
+        drive[i] = amp[i] * m;
+    }
+
+    // keep the phasors on the unit circle over long runs
+    if ((++set->ticks & 4095) == 0) {
+        for (int i = 0; i < n; i++) {
+            float inv = 1.0f / sqrtf(re[i] * re[i] + im[i] * im[i]);
+            re[i] *= inv;
+            im[i] *= inv;
+        }
+    }
+
+    // scatter into the field
+    const int64_t *cell = set->cell;
+    const float *gain = set->gain;
+    cell_t *field = fluid->previous;
+    for (int i = 0; i < n; i++) {
+        field[cell[i]] = CELL_STORE(CELL_LOAD(field[cell[i]]) * gain[i] + drive[i]);
+    }
+}
+
+void free_probes(ProbeSet *set) {
+    free(set->x);
+    free(set->y);
+    free(set->base);
+    free(set->fx);
+    free(set->fy);
+    free(set->slot);
+    free(set->ring);
+    free(set->ring_step);
+    memset(set, 0, sizeof(*set));
+}
+
+// probes sit anywhere in the grid at sub-cell positions. only before start_probes
+int add_probe(ProbeSet *set, float x, float y) {
+    if (set->frames) {
+        printf("Probes are already recording\n");
+        return 0;
+    }
+    if (!(x >= 0.0f && x <= GRID_WIDTH - 1 && y >= 0.0f && y <= GRID_HEIGHT - 1)) {
+        printf("Probe %g,%g is outside the %dx%d grid\n", x, y, GRID_WIDTH, GRID_HEIGHT);
+        return 0;
+    }
+
+    if (set->count == set->capacity) {
+        int n = set->capacity ? set->capacity * 2 : 64;
+        float *px = realloc(set->x, n * sizeof(float));
+        if (px) set->x = px;
+        float *py = realloc(set->y, n * sizeof(float));
+        if (py) set->y = py;
+        if (!px || !py) {
+            printf("Failed to allocate probes\n");
+            return 0;
+        }
+        set->capacity = n;
+    }
+    set->x[set->count] = x;
+    set->y[set->count] = y;
+    set->count++;
+    return 1;
+}
+
+// one "x y" per line, # starts a comment
+int load_probes(ProbeSet *set, const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        printf("Failed to open %s\n", path);
+        return 0;
+    }
+    char line[256];
+    int ok = 1, number = 0;
+    while (ok && fgets(line, sizeof(line), f)) {
+        number++;
+        char *hash = strchr(line, '#');
+        if (hash) *hash = 0;
+        float x, y;
+        char rest;
+        int got = sscanf(line, "%f %f %c", &x, &y, &rest);
+        if (got <= 0) continue;
+        if (got != 2) {
+            printf("%s:%d: expected \"x y\"\n", path, number);
+            ok = 0;
+        } else {
+            ok = add_probe(set, x, y);
+        }
+    }
+    fclose(f);
+    return ok;
+}
+
+// nx by ny probes evenly over the grid
+int add_probe_grid(ProbeSet *set, int nx, int ny) {
+    for (int j = 0; j < ny; j++) {
+        for (int i = 0; i < nx; i++) {
+            float x = (i + 0.5f) * (GRID_WIDTH - 1) / nx;
+            float y = (j + 0.5f) * (GRID_HEIGHT - 1) / ny;
+            if (!add_probe(set, x, y)) return 0;
+        }
+    }
+    return 1;
+}
+
+typedef struct {
+    int64_t base;
+    int probe;
+} ProbeKey;
+
+static int compare_probe_key(const void *a, const void *b) {
+    const ProbeKey *pa = a, *pb = b;
+    if (pa->base != pb->base) return pa->base < pb->base ? -1 : 1;
+    return pa->probe - pb->probe;
+}
+
+// sorts the gathers and allocates the ring, nothing is allocated per step afterwards
+int start_probes(ProbeSet *set, int frames) {
+    int n = set->count;
+    if (n == 0) return 1;
+    if (frames < 1) frames = 1;
+
+    ProbeKey *keys = malloc(n * sizeof(ProbeKey));
+    set->base = malloc(n * sizeof(int64_t));
+    set->fx = malloc(n * sizeof(float));
+    set->fy = malloc(n * sizeof(float));
+    set->slot = malloc(n * sizeof(int));
+    set->ring = malloc((size_t)frames * n * sizeof(float));
+    set->ring_step = malloc(frames * sizeof(uint64_t));
+    if (!keys || !set->base || !set->fx || !set->fy || !set->slot || !set->ring || !set->ring_step) {
+        printf("Failed to allocate %d probe frames\n", frames);
+        free(keys);
+        return 0;
+    }
+
+    for (int i = 0; i < n; i++) {
+        // the last row and column use the cell before them, with weight 1 on the far side
+        int x0 = (int)set->x[i], y0 = (int)set->y[i];
+        if (x0 > GRID_WIDTH - 2) x0 = GRID_WIDTH - 2;
+        if (y0 > GRID_HEIGHT - 2) y0 = GRID_HEIGHT - 2;
+        keys[i].base = (int64_t)y0 * GRID_WIDTH + x0;
+        keys[i].probe = i;
+    }
+    qsort(keys, n, sizeof(ProbeKey), compare_probe_key);
+
+    for (int k = 0; k < n; k++) {
+        int i = keys[k].probe;
+        set->base[k] = keys[k].base;
+        set->fx[k] = set->x[i] - (float)(keys[k].base % GRID_WIDTH);
+        set->fy[k] = set->y[i] - (float)(keys[k].base / GRID_WIDTH);
+        set->slot[i] = k;
+    }
+    free(keys);
+
+    set->frames = frames;
+    set->recorded = 0;
+    return 1;
+}
+
+void sample_probes(ProbeSet *set, const FluidGrid *fluid) {
+    if (set->frames == 0) return;
+
+    int n = set->count;
+    size_t row = set->recorded % set->frames;
+    float *restrict out = set->ring + row * n;
+    const int64_t *restrict base = set->base;
+    const float *restrict fx = set->fx;
+    const float *restrict fy = set->fy;
+    const cell_t *field = fluid->current;
+
+    for (int k = 0; k < n; k++) {
+        const cell_t *c = field + base[k];
+        float top = CELL_LOAD(c[0]) + (CELL_LOAD(c[1]) - CELL_LOAD(c[0])) * fx[k];
+        float bottom = CELL_LOAD(c[GRID_WIDTH]) +
+                       (CELL_LOAD(c[GRID_WIDTH + 1]) - CELL_LOAD(c[GRID_WIDTH])) * fx[k];
+        out[k] = top + (bottom - top) * fy[k];
+    }
+    set->ring_step[row] = fluid->step;
+    set->recorded++;
+}
+
+// binary probe file: header, probe positions, then per frame the step and the values
+#define PROBE_MAGIC 0x52504C46  // "FLPR"
+#define PROBE_VERSION 1
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;
+    uint32_t frames;
+} ProbeFileHeader;
+
+// what is still in the ring, oldest first. csv for a .csv path, binary otherwise
+int write_probes(const ProbeSet *set, const char *path) {
+    if (set->frames == 0) return 1;
+
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        printf("Failed to open %s\n", path);
+        return 0;
+    }
+
+    int n = set->count;
+    uint64_t kept = set->recorded < (uint64_t)set->frames ? set->recorded : (uint64_t)set->frames;
+    uint64_t first = set->recorded - kept;
+    const char *ext = strrchr(path, '.');
+    int csv = ext && strcmp(ext, ".csv") == 0;
+    float *values = malloc(n * sizeof(float));
+    if (!values) {
+        fclose(f);
+        return 0;
+    }
+
+    if (csv) {
+        fprintf(f, "step");
+        for (int i = 0; i < n; i++) fprintf(f, ",p%d@%g:%g", i, set->x[i], set->y[i]);
+        fprintf(f, "\n");
+    } else {
+        ProbeFileHeader header = { PROBE_MAGIC, PROBE_VERSION, n, (uint32_t)kept };
+        fwrite(&header, sizeof(header), 1, f);
+        fwrite(set->x, sizeof(float), n, f);
+        fwrite(set->y, sizeof(float), n, f);
+    }
+
+    for (uint64_t r = first; r < set->recorded; r++) {
+        size_t row = r % set->frames;
+        const float *sorted = set->ring + row * n;
+        for (int i = 0; i < n; i++) values[i] = sorted[set->slot[i]];
+
+        if (csv) {
+            fprintf(f, "%llu", (unsigned long long)set->ring_step[row]);
+            for (int i = 0; i < n; i++) fprintf(f, ",%.9g", values[i]);
+            fprintf(f, "\n");
+        } else {
+            fwrite(&set->ring_step[row], sizeof(uint64_t), 1, f);
+            fwrite(values, sizeof(float), n, f);
+        }
+    }
+    free(values);
+
+    int ok = !ferror(f);
+    if (fclose(f) != 0) ok = 0;
+    if (!ok) printf("Failed to write %s\n", path);
+    return ok;
+}
+
+int init_obstacles(ObstacleMask *m) {
+    m->words = (GRID_WIDTH + 63) / 64;
+    m->bits = calloc((size_t)m->words * GRID_HEIGHT, sizeof(uint64_t));
+    m->rows = calloc(GRID_HEIGHT, 1);
+    m->solid = 0;
+    if (!m->bits || !m->rows) {
+        printf("Failed to allocate the obstacle mask\n");
+        return 0;
+    }
+    return 1;
+}
+
+void free_obstacles(ObstacleMask *m) {
+    free(m->bits);
+    free(m->rows);
+    memset(m, 0, sizeof(*m));
+}
+
+static inline int obstacle_at(const ObstacleMask *m, int x, int y) {
+    return (m->bits[(size_t)y * m->words + (x >> 6)] >> (x & 63)) & 1;
+}
+
+// rows mask_row rewrites: those near solid cells, and with periodic edges the
+// two next to the seam, whose neighbours across it are the far interior rows
+static inline int masked_row(const FluidGrid *fluid, int y) {
+    const ObstacleMask *m = fluid->obstacles;
+    if (!m) return 0;
+    if (m->rows[y]) return 1;
+    return fluid->boundary.mode == BOUNDARY_PERIODIC && (y == 1 || y == GRID_HEIGHT - 2);
+}
+
+void set_obstacle(ObstacleMask *m, int x, int y, int solid) {
+    if (x < 0 || x >= GRID_WIDTH || y < 0 || y >= GRID_HEIGHT) return;
+    uint64_t *word = &m->bits[(size_t)y * m->words + (x >> 6)];
+    uint64_t bit = (uint64_t)1 << (x & 63);
+    *word = solid ? *word | bit : *word & ~bit;
+}
+
+// after edits: recount and redo the row flags
+void finish_obstacles(ObstacleMask *m) {
+    m->solid = 0;
+    uint8_t *has = calloc(GRID_HEIGHT, 1);
+    if (!has) return;
+    for (int y = 0; y < GRID_HEIGHT; y++) {
+        const uint64_t *row = m->bits + (size_t)y * m->words;
+        for (int w = 0; w < m->words; w++) m->solid += __builtin_popcountll(row[w]);
+        for (int w = 0; w < m->words && !has[y]; w++) has[y] = row[w] != 0;
+    }
+    // rows within reach of a solid cell, step_row checks their tiles for the wide stencil
+    int reach = FLUID_STENCIL == STENCIL_13 ? 2 : 1;
+    for (int y = 0; y < GRID_HEIGHT; y++) {
+        m->rows[y] = 0;
+        for (int r = y - reach; r <= y + reach; r++)
+            if (r >= 0 && r < GRID_HEIGHT && has[r]) m->rows[y] = 1;
+    }
+    free(has);
+}
+
+// next header token of a pgm, skipping whitespace and # comments
+static int pgm_token(FILE *f) {
+    int c = fgetc(f);
+    for (;;) {
+        while (c == ' ' || c == '\t' || c == '\r' || c == '\n') c = fgetc(f);
+        if (c != '#') break;
+        while (c != '\n' && c != EOF) c = fgetc(f);
+    }
+    int v = -1;
+    while (c >= '0' && c <= '9') {
+        v = (v < 0 ? 0 : v * 10) + (c - '0');
+        c = fgetc(f);
+    }
+    return v;   // the single whitespace after a header value is consumed here
+}
+
+// binary (P5) or ascii (P2) pgm, 8 or 16 bit, as 16 bit values
+static uint16_t *read_pgm(const char *path, int *width, int *height, int *maxval) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        printf("Failed to open %s\n", path);
+        return NULL;
+    }
+    int ascii = 0;
+    if (fgetc(f) != 'P' || ((ascii = fgetc(f)) != '5' && ascii != '2')) {
+        printf("%s is not a pgm (P5 or P2)\n", path);
+        fclose(f);
+        return NULL;
+    }
+    ascii = ascii == '2';
+    int w = pgm_token(f), h = pgm_token(f), max = pgm_token(f);
+    if (w <= 0 || h <= 0 || max <= 0 || max > 65535) {
+        printf("Bad pgm header in %s\n", path);
+        fclose(f);
+        return NULL;
+    }
+
+    int wide = max > 255;
+    uint16_t *image = malloc((size_t)w * h * sizeof(uint16_t));
+    int ok = image != NULL;
+    for (size_t i = 0; ok && i < (size_t)w * h; i++) {
+        if (ascii) {
+            int v = pgm_token(f);
+            ok = v >= 0;
+            image[i] = v;
+        } else {
+            int hi = wide ? fgetc(f) : 0;
+            int lo = fgetc(f);
+            ok = hi != EOF && lo != EOF;
+            image[i] = (uint16_t)(hi << 8 | lo);
+        }
+    }
+    fclose(f);
+    if (!ok) {
+        printf("Failed to read %s\n", path);
+        free(image);
+        return NULL;
+    }
+    *width = w;
+    *height = h;
+    *maxval = max;
+    return image;
+}
+
+// image pixel under grid cell x,y when the image is stretched over the grid
+static inline uint16_t pgm_at(const uint16_t *image, int w, int h, int x, int y) {
+    return image[(size_t)((int64_t)y * h / GRID_HEIGHT) * w + (int64_t)x * w / GRID_WIDTH];
+}
+
+// dark pixels (below half of the max value) are solid
+int load_obstacles(ObstacleMask *m, const char *path) {
+    int w, h, maxval;
+    uint16_t *image = read_pgm(path, &w, &h, &maxval);
+    if (!image) return 0;
+    if (!init_obstacles(m)) {
+        free(image);
+        return 0;
+    }
+    for (int y = 0; y < GRID_HEIGHT; y++)
+        for (int x = 0; x < GRID_WIDTH; x++)
+            if (pgm_at(image, w, h, x, y) * 2 < maxval) set_obstacle(m, x, y, 1);
+    free(image);
+    finish_obstacles(m);
+    return 1;
+}
+
+int init_speed(SpeedMap *m) {
+    m->tiles = (GRID_WIDTH + MAP_TILE - 1) / MAP_TILE;
+    m->q = malloc(GRID_CELLS);
+    m->tile = malloc((size_t)m->tiles * GRID_HEIGHT * sizeof(uint16_t));
+    m->rows = calloc(GRID_HEIGHT, 1);
+    if (!m->q || !m->tile || !m->rows) {
+        printf("Failed to allocate the speed map\n");
+        return 0;
+    }
+    memset(m->q, SPEED_BASE, GRID_CELLS);
+    for (size_t i = 0; i < (size_t)m->tiles * GRID_HEIGHT; i++) m->tile[i] = SPEED_BASE;
+    return 1;
+}
+
+void free_speed(SpeedMap *m) {
+    free(m->q);
+    free(m->tile);
+    free(m->rows);
+    memset(m, 0, sizeof(*m));
+}
+
+// tiles of a byte map, and the rows with some tile off base
+static void map_tiles(const uint8_t *q, uint16_t *tiles, uint8_t *rows, int base) {
+    int n = (GRID_WIDTH + MAP_TILE - 1) / MAP_TILE;
+    for (int y = 0; y < GRID_HEIGHT; y++) {
+        const uint8_t *row = q + (size_t)y * GRID_WIDTH;
+        uint16_t *tile = tiles + (size_t)y * n;
+        rows[y] = 0;
+        for (int t = 0; t < n; t++) {
+            int x0 = t * MAP_TILE;
+            int x1 = x0 + MAP_TILE < GRID_WIDTH ? x0 + MAP_TILE : GRID_WIDTH;
+            tile[t] = row[x0];
+            for (int x = x0 + 1; x < x1; x++) if (row[x] != row[x0]) tile[t] = MAP_MIXED;
+            rows[y] |= tile[t] != base;
+        }
+    }
+}
+
+// after edits: redo the tiles. also mur's (c - 1) / (c + 1) per value, with the
+// courant number c the square root of the coefficient
+void finish_speed(SpeedMap *m) {
+    map_tiles(m->q, m->tile, m->rows, SPEED_BASE);
+    for (int v = 0; v < 256; v++) {
+        float c = sqrtf(v / 512.0f);
+        m->mur[v] = (c - 1.0f) / (c + 1.0f);
+    }
+}
+
+// a depth image: the squared speed of shallow water waves goes with depth, so
+// white is the default speed times scale, black is still water that does not carry waves
+int load_depth(SpeedMap *m, const char *path, float scale) {
+    int w, h, maxval;
+    uint16_t *image = read_pgm(path, &w, &h, &maxval);
+    if (!image) return 0;
+    if (!init_speed(m)) {
+        free(image);
+        return 0;
+    }
+    for (int y = 0; y < GRID_HEIGHT; y++) {
+        for (int x = 0; x < GRID_WIDTH; x++) {
+            float v = SPEED_BASE * scale * pgm_at(image, w, h, x, y) / maxval;
+            v = v < 0.0f ? 0.0f : (v > 255.0f ? 255.0f : v);
+            m->q[(size_t)y * GRID_WIDTH + x] = (uint8_t)lrintf(v);
+        }
+    }
+    free(image);
+    finish_speed(m);
+    return 1;
+}
+
+int init_damping_map(DampingMap *m) {
+    m->tiles = (GRID_WIDTH + MAP_TILE - 1) / MAP_TILE;
+    m->q = calloc(GRID_CELLS, 1);
+    m->tile = calloc((size_t)m->tiles * GRID_HEIGHT, sizeof(uint16_t));
+    m->rows = calloc(GRID_HEIGHT, 1);
+    if (!m->q || !m->tile || !m->rows) {
+        printf("Failed to allocate the damping map\n");
+        return 0;
+    }
+    for (int v = 0; v < 256; v++) m->factor[v] = 1.0f;
+    return 1;
+}
+
+void free_damping_map(DampingMap *m) {
+    free(m->q);
+    free(m->tile);
+    free(m->rows);
+    memset(m, 0, sizeof(*m));
+}
+
+// after edits: redo the tiles, and the factors for a loss per step at 255
+void finish_damping_map(DampingMap *m, float loss) {
+    map_tiles(m->q, m->tile, m->rows, 0);
+    m->loss = loss;
+    for (int v = 0; v < 256; v++) m->factor[v] = 1.0f - loss * v / 255.0f;
+}
+
+// black pixels lose loss more of their motion every step than white ones
+int load_damping_map(DampingMap *m, const char *path, float loss) {
+    int w, h, maxval;
+    uint16_t *image = read_pgm(path, &w, &h, &maxval);
+    if (!image) return 0;
+    if (!init_damping_map(m)) {
+        free(image);
+        return 0;
+    }
+    for (int y = 0; y < GRID_HEIGHT; y++)
+        for (int x = 0; x < GRID_WIDTH; x++)
+            m->q[(size_t)y * GRID_WIDTH + x] =
+                (uint8_t)(255 - ((int64_t)pgm_at(image, w, h, x, y) * 255 + maxval / 2) / maxval);
+    free(image);
+    finish_damping_map(m, loss);
+    return 1;
+}
+
+// hands the mask to the grid and zeroes the solid cells in both time levels
+void attach_obstacles(FluidGrid *fluid, const ObstacleMask *m) {
+    fluid->obstacles = m;
+    if (!m) return;
+    for (int y = 0; y < GRID_HEIGHT; y++) {
+        if (!m->rows[y]) continue;
+        for (int x = 0; x < GRID_WIDTH; x++) {
+            if (!obstacle_at(m, x, y)) continue;
+            size_t idx = (size_t)y * GRID_WIDTH + x;
+            fluid->current[idx] = fluid->previous[idx] = 0;
+#if FLUID_STORAGE == FLUID_KAHAN
+            fluid->current_lo[idx] = fluid->previous_lo[idx] = 0;
+#endif
+        }
+    }
+    touch_all(fluid);
+}
+
+static void clear_band_stats(BandStats *s) {
+    memset(s, 0, sizeof(*s));
+    s->x0 = s->y0 = INT32_MAX;
+    s->x1 = s->y1 = -1;
+}
+
+static void merge_band_stats(BandStats *dst, const BandStats *src) {
+    dst->energy += src->energy;
+    if (src->peak > dst->peak) dst->peak = src->peak;
+    dst->active += src->active;
+    if (src->x0 < dst->x0) dst->x0 = src->x0;
+    if (src->y0 < dst->y0) dst->y0 = src->y0;
+    if (src->x1 > dst->x1) dst->x1 = src->x1;
+    if (src->y1 > dst->y1) dst->y1 = src->y1;
+}
+
+// widened storages hand over their float32 row, the others the stored one
+#ifdef CELL_WIDENED
+typedef float stat_row_t;
+#define STAT_LOAD(v) (v)
+#define STAT_ROW_FLOAT 1
+#else
+typedef cell_t stat_row_t;
+#define STAT_LOAD(v) ((float)CELL_LOAD(v))
+#define STAT_ROW_FLOAT (FLUID_STORAGE == FLUID_FLOAT32 || FLUID_STORAGE == FLUID_KAHAN)
+#endif
+
+// gcc vector extensions, the plain loop did not vectorize once the max and the
+// denormal guard were in it. native width only, wider vectors get split into
+// scalar compares on SSE2
+#ifdef __AVX__
+#define STAT_LANES 8
+#else
+#define STAT_LANES 4
+#endif
+typedef float stat_vec __attribute__((vector_size(STAT_LANES * sizeof(float))));
+typedef int32_t stat_mask __attribute__((vector_size(STAT_LANES * sizeof(int32_t))));
+
+static inline stat_vec stat_load(const stat_row_t *row) {
+    stat_vec v = {0};
+#if STAT_ROW_FLOAT
+    memcpy(&v, row, sizeof(v));
+#else
+    for (int k = 0; k < STAT_LANES; k++) v[k] = STAT_LOAD(row[k]);
+#endif
+    return v;
+}
+
+static inline stat_vec stat_abs(stat_vec v) {
+    return (stat_vec)((stat_mask)v & 0x7FFFFFFF);
+}
+
+// b where either is NaN, like maxps
+static inline stat_vec stat_vmax(stat_vec a, stat_vec b) {
+#if defined(__AVX__)
+    return __builtin_ia32_maxps256(a, b);
+#elif defined(__SSE__)
+    return __builtin_ia32_maxps(a, b);
+#else
+    stat_mask higher = a > b;
+    return (stat_vec)(((stat_mask)a & higher) | ((stat_mask)b & ~higher));
+#endif
+}
+
+static inline void stat_lanes(stat_vec a, stat_vec *energy, stat_vec *peak) {
+    // squaring a decayed ripple gives a denormal and a microcode assist, so
+    // anything under 1e-18 is squared as 1e-18. a million cells of that add
+    // up to 1e-30, a max is one op where masking to zero took two
+    stat_vec e = stat_vmax(a, (stat_vec){0} + 1e-18f);
+    *energy += e * e;
+    *peak = stat_vmax(a, *peak);
+}
+
+// energy and peak lanes the kernels carry along the rows they write, over
+// columns x0..x1 of them
+typedef struct {
+    stat_vec energy, peak;
+    int x0, x1;
+} StatLanes;
+
+// cells per strip of a kernel's row loop. after each strip the kernel folds
+// the cells it just wrote into its lanes, while they are still in L1
+#define STAT_STRIP 256
+
+static inline __attribute__((always_inline)) void stat_span(StatLanes *lanes, const stat_row_t *row,
+                                                            int x0, int x1) {
+    if (x0 < lanes->x0) x0 = lanes->x0;
+    if (x1 > lanes->x1) x1 = lanes->x1;
+    if (x0 >= x1) return;
+    stat_vec energy = lanes->energy, peak = lanes->peak;
+    stat_vec e1 = {0}, e2 = {0}, e3 = {0}, p1 = {0};
+
+    // four sets of lanes per iteration, one add chain was the bottleneck
+    int x = x0;
+    for (; x + 4 * STAT_LANES <= x1; x += 4 * STAT_LANES) {
+        stat_lanes(stat_abs(stat_load(row + x)), &energy, &peak);
+        stat_lanes(stat_abs(stat_load(row + x + STAT_LANES)), &e1, &p1);
+        stat_lanes(stat_abs(stat_load(row + x + 2 * STAT_LANES)), &e2, &peak);
+        stat_lanes(stat_abs(stat_load(row + x + 3 * STAT_LANES)), &e3, &p1);
+    }
+    energy += (e1 + e2) + e3;
+    peak = stat_vmax(p1, peak);
+    for (; x + STAT_LANES <= x1; x += STAT_LANES) stat_lanes(stat_abs(stat_load(row + x)), &energy, &peak);
+    for (; x < x1; x++) {
+        float a = fabsf(STAT_LOAD(row[x]));
+        energy[0] += a > 1e-18f ? a * a : 1e-36f;
+        if (a > peak[0]) peak[0] = a;
+    }
+    lanes->energy = energy;
+    lanes->peak = peak;
+}
+
+static inline float stat_max(stat_vec v) {
+    float m = 0.0f;
+    for (int k = 0; k < STAT_LANES; k++) m = fmaxf(m, v[k]);
+    return m;
+}
+
+// nonzero if any of the lanes at x is active
+static inline int stat_any(const stat_row_t *row, float threshold) {
+    stat_mask on = stat_abs(stat_load(row)) > threshold;
+    int any = 0;
+    for (int k = 0; k < STAT_LANES; k++) any |= on[k];
+    return any;
+}
+
+// box edges of a row with a cell over the threshold: scan in from both ends a
+// vector at a time. busy rows stop right away, a lone ripple costs one extra
+// read of the row at most
+static void row_box(BandStats *s, const stat_row_t *row, int y, float threshold, int x0, int x1) {
+    int lo = x0, hi = x1 - 1;
+    while (lo + STAT_LANES <= hi && !stat_any(row + lo, threshold)) lo += STAT_LANES;
+    while (!(fabsf(STAT_LOAD(row[lo])) > threshold)) lo++;
+    while (hi - STAT_LANES >= lo && !stat_any(row + hi - STAT_LANES + 1, threshold)) hi -= STAT_LANES;
+    while (!(fabsf(STAT_LOAD(row[hi])) > threshold)) hi--;
+
+    if (lo < s->x0) s->x0 = lo;
+    if (hi > s->x1) s->x1 = hi;
+    if (y < s->y0) s->y0 = y;
+    s->y1 = y;
+}
+
+// the full pass over a written row, with the active count: counting steps,
+// and rows the obstacles or a speed map rewrite after the kernel
+static void row_stats(BandStats *s, const stat_row_t *restrict row, int y, float threshold, int x0, int x1) {
+    stat_vec energy_v[2] = {{0}}, peak_v[2] = {{0}};
+    stat_mask count_v[2] = {{0}};
+
+    // two sets of lanes per iteration to split the add chains
+    int x = x0;
+    for (; x + 2 * STAT_LANES <= x1; x += 2 * STAT_LANES) {
+        for (int i = 0; i < 2; i++) {
+            stat_vec a = stat_abs(stat_load(row + x + i * STAT_LANES));
+            stat_lanes(a, &energy_v[i], &peak_v[i]);
+            count_v[i] -= a > threshold;
+        }
+    }
+
+    float energy = 0.0f, peak = 0.0f;
+    int count = 0;
+    for (int k = 0; k < STAT_LANES; k++) {
+        energy += energy_v[0][k] + energy_v[1][k];
+        peak = fmaxf(peak, fmaxf(peak_v[0][k], peak_v[1][k]));
+        count += count_v[0][k] + count_v[1][k];
+    }
+    for (; x < x1; x++) {
+        float a = fabsf(STAT_LOAD(row[x]));
+        energy += a > 1e-18f ? a * a : 1e-36f;
+        if (a > peak) peak = a;
+        count += a > threshold;
+    }
+
+    s->energy += energy;
+    if (peak > s->peak) s->peak = peak;
+    if (count == 0) return;
+    s->active += count;
+    row_box(s, row, y, threshold, x0, x1);
+}
+
+// the kernels gather columns m..GRID_WIDTH - m of the rows at least m from the
+// top and bottom. m is 1 except with a sponge, whose cells boundary_band
+// gathers once it has damped them
+static inline int stat_margin(const FluidGrid *fluid) {
+    return fluid->boundary.mode == BOUNDARY_SPONGE ? fluid->boundary.width : 1;
+}
+
+static inline int stat_row_skipped(int y, int m) {
+    return y < m || y >= GRID_HEIGHT - m;
+}
+
+// lanes for the kernel to fill on row y, NULL when the row takes the full pass
+// or none at all
+static inline StatLanes *row_lanes(const FluidGrid *fluid, StatLanes *lanes, int y) {
+    int m = stat_margin(fluid);
+    if (fluid->stats->level == STATS_COUNT || stat_row_skipped(y, m)) return NULL;
+    if (masked_row(fluid, y)) return NULL;
+#if FLUID_STORAGE == FLUID_INT16 || FLUID_STORAGE == FLUID_KAHAN
+    if (fluid->speed && fluid->speed->rows[y]) return NULL;
+#endif
+    memset(lanes, 0, sizeof(*lanes));
+    lanes->x0 = m;
+    lanes->x1 = GRID_WIDTH - m;
+    return lanes;
+}
+
+// a row the kernel has written, with its lanes from row_lanes. the lanes go
+// into the band's and are reduced once per band
+static void gather_row(const FluidGrid *fluid, BandStats *s, StatLanes *band, const StatLanes *lanes,
+                       const stat_row_t *row, int y) {
+    float threshold = fluid->stats->threshold;
+    int m = stat_margin(fluid);
+    if (stat_row_skipped(y, m)) return;
+    if (!lanes) {
+        row_stats(s, row, y, threshold, m, GRID_WIDTH - m);
+        return;
+    }
+    band->energy += lanes->energy;
+    band->peak = stat_vmax(lanes->peak, band->peak);
+    if (fluid->stats->level == STATS_BOXES && stat_max(lanes->peak) > threshold)
+        row_box(s, row, y, threshold, m, GRID_WIDTH - m);
+}
+
+static void gather_band(BandStats *s, const StatLanes *band) {
+    double energy = 0.0;
+    for (int k = 0; k < STAT_LANES; k++) energy += band->energy[k];
+    s->energy += energy;
+    float peak = stat_max(band->peak);
+    if (peak > s->peak) s->peak = peak;
+}
+
+// rows the kernels hand to mask_row: the widened float32 row, or the stored one
+#ifdef CELL_WIDENED
+typedef float mask_row_t;
+#define MASK_LOAD(v) (v)
+#define MASK_STORE(f) (f)
+#else
+typedef cell_t mask_row_t;
+#define MASK_LOAD(v) CELL_LOAD(v)
+#define MASK_STORE(f) CELL_STORE(f)
+#endif
+
+// rows of a damping map with something off 0, NULL otherwise
+static inline const uint8_t *damping_row(const FluidGrid *fluid, int y) {
+    const DampingMap *m = fluid->damping_map;
+    return m && m->rows[y] ? m->q + (size_t)y * GRID_WIDTH : NULL;
+}
+
+// what the kernels multiplied the laplacian term of cell x by, besides its
+// coefficient: the cell's damping under the height model, nothing under the velocity one
+static inline calc_t laplacian_damping(const FluidGrid *fluid, const uint8_t *dq, int x) {
+    if (fluid->damping_model == DAMPING_VELOCITY) return 1;
+    return dq ? (calc_t)fluid->damping * fluid->damping_map->factor[dq[x]] : (calc_t)fluid->damping;
+}
+
+#if FLUID_STORAGE == FLUID_INT16 || FLUID_STORAGE == FLUID_KAHAN
+// wave speed for the kernels with their own row loops, applied to a row just
+// stepped with 0.25. the laplacian only depends on the previous field, which is
+// still there, so the result is topped up with (k - 0.25) times the laplacian
+// and whatever damping the kernel put on it. tiles at SPEED_BASE are skipped
+static void speed_row(const FluidGrid *fluid, int y, mask_row_t *restrict out, const mask_row_t *up,
+                      const mask_row_t *mid, const mask_row_t *down) {
+    const SpeedMap *m = fluid->speed;
+    if (!m->rows[y]) return;
+
+    const uint16_t *tile = m->tile + (size_t)y * m->tiles;
+    const uint8_t *q = m->q + (size_t)y * GRID_WIDTH;
+    const uint8_t *dq = damping_row(fluid, y);
+
+    for (int t = 0; t < m->tiles; t++) {
+        if (tile[t] == SPEED_BASE) continue;
+        int x0 = t * MAP_TILE < 1 ? 1 : t * MAP_TILE;
+        int x1 = (t + 1) * MAP_TILE < GRID_WIDTH - 1 ? (t + 1) * MAP_TILE : GRID_WIDTH - 1;
+        int mixed = tile[t] == MAP_MIXED;
+
+        for (int x = x0; x < x1; x++) {
+            int k = mixed ? q[x] : tile[t];
+            calc_t laplacian = MASK_LOAD(mid[x - 1]) + MASK_LOAD(mid[x + 1]) + MASK_LOAD(up[x]) +
+                               MASK_LOAD(down[x]) - 4 * MASK_LOAD(mid[x]);
+            calc_t gain = (k - SPEED_BASE) * ((calc_t)1 / 512) * laplacian_damping(fluid, dq, x);
+            out[x] = MASK_STORE(MASK_LOAD(out[x]) + gain * laplacian);
+        }
+    }
+}
+#else
+// k times the laplacian at x. the wide form is the fourth order cross plus
+// k / 12 times the biharmonic, which cancels the leading error of the leapfrog
+// in time as well, so the whole step is fourth order. it reads two cells each way
+static inline __attribute__((always_inline)) calc_t wave_term(const mask_row_t *up, const mask_row_t *mid,
+                                                              const mask_row_t *down, int x, calc_t k, int wide) {
+    calc_t c = mid[x];
+#if FLUID_STENCIL == STENCIL_13
+    if (wide) {
+        const mask_row_t *up2 = up - GRID_WIDTH, *down2 = down + GRID_WIDTH;
+        calc_t near = mid[x - 1] + mid[x + 1] + up[x] + down[x];
+        calc_t far = mid[x - 2] + mid[x + 2] + up2[x] + down2[x];
+        calc_t corners = up[x - 1] + up[x + 1] + down[x - 1] + down[x + 1];
+        calc_t biharmonic = far - 8 * near + 2 * corners + 20 * c;
+        return k * ((calc_t)1 / 12) * (16 * near - far - 60 * c + k * biharmonic);
+    }
+#else
+    (void)wide;
+#endif
+
+    calc_t laplacian = 
+        mid[x - 1] +
+        mid[x + 1] +
+        up[x] +
+        down[x] -
+        4 * c;
+    return laplacian * k;
+}
+
+// one leapfrog step of cells x0..x1 of a row, with the squared wave speed k
+// (0.25 without a speed map) and damping d. with lanes, the row goes in strips
+// and each strip is folded into them right after it is written
+static inline __attribute__((always_inline)) void step_span(mask_row_t *restrict out, const mask_row_t *up,
+                                                            const mask_row_t *mid, const mask_row_t *down,
+                                                            int x0, int x1, calc_t k, calc_t d,
+                                                            int velocity, int wide, StatLanes *lanes) {
+    StatLanes acc = lanes ? *lanes : (StatLanes){{0}, {0}};
+    int strip = lanes ? STAT_STRIP : x1 - x0;
+    for (int s = x0; s < x1; s += strip) {
+        int e = s + strip < x1 ? s + strip : x1;
+        for (int x = s; x < e; x++) {
+            calc_t c = mid[x];
+
+            // wave
+            calc_t wave = wave_term(up, mid, down, x, k, wide);
+
+            // up damp
+            if (velocity) out[x] = c + (c - out[x]) * d + wave;
+            else out[x] = (2 * c - out[x] + wave) * d;
+        }
+        if (lanes) stat_span(&acc, out, s, e);
+    }
+    if (lanes) *lanes = acc;
+}
+
+// the same with k and d per cell, from tile sized arrays starting at x0
+static inline __attribute__((always_inline)) void step_cells(mask_row_t *restrict out, const mask_row_t *up,
+                                                             const mask_row_t *mid, const mask_row_t *down,
+                                                             int x0, int x1, const calc_t *restrict k,
+                                                             const calc_t *restrict d, int velocity, int wide,
+                                                             StatLanes *lanes) {
+    k -= x0;
+    d -= x0;
+    for (int x = x0; x < x1; x++) {
+        calc_t c = mid[x];
+        calc_t wave = wave_term(up, mid, down, x, k[x], wide);
+        if (velocity) out[x] = c + (c - out[x]) * d[x] + wave;
+        else out[x] = (2 * c - out[x] + wave) * d[x];
+    }
+    // at most a tile, it is all still in L1
+    if (lanes) stat_span(lanes, out, x0, x1);
+}
+
+// cells x0..x1 with either constants or per cell arrays (kx non NULL), calling
+// the loops above with constant flags so each combination is its own loop
+static void step_tile(mask_row_t *restrict out, const mask_row_t *up, const mask_row_t *mid,
+                      const mask_row_t *down, int x0, int x1, calc_t k, calc_t d,
+                      const calc_t *kx, const calc_t *dx, int velocity, int wide, StatLanes *lanes) {
+#if FLUID_STENCIL == STENCIL_13
+    if (wide) {
+        // the columns next to the edges keep the cross, the wide form would read past them
+        int a = x0 < 2 ? 2 : x0;
+        int b = x1 > GRID_WIDTH - 2 ? GRID_WIDTH - 2 : x1;
+        if (x0 < a) step_tile(out, up, mid, down, x0, a, k, d, kx, dx, velocity, 0, lanes);
+        if (b < x1) step_tile(out, up, mid, down, b, x1, k, d, kx ? kx + (b - x0) : NULL,
+                              dx ? dx + (b - x0) : NULL, velocity, 0, lanes);
+        if (a >= b) return;
+        if (kx) {
+            if (velocity) step_cells(out, up, mid, down, a, b, kx + (a - x0), dx + (a - x0), 1, 1, lanes);
+            else step_cells(out, up, mid, down, a, b, kx + (a - x0), dx + (a - x0), 0, 1, lanes);
+        } else {
+            if (velocity) step_span(out, up, mid, down, a, b, k, d, 1, 1, lanes);
+            else step_span(out, up, mid, down, a, b, k, d, 0, 1, lanes);
+        }
+        return;
+    }
+#else
+    (void)wide;
+#endif
+    if (kx) {
+        if (velocity) step_cells(out, up, mid, down, x0, x1, kx, dx, 1, 0, lanes);
+        else step_cells(out, up, mid, down, x0, x1, kx, dx, 0, 0, lanes);
+    } else {
+        if (velocity) step_span(out, up, mid, down, x0, x1, k, d, 1, 0, lanes);
+        else step_span(out, up, mid, down, x0, x1, k, d, 0, 0, lanes);
+    }
+}
+
+// nonzero when the wide stencil of every cell in tile t of row y stays clear of
+// solid cells. tiles are the mask's 64 bit words, so that is the word and the
+// two columns either side of it, in the rows up to two away
+static int wide_tile(const ObstacleMask *m, int y, int t) {
+    for (int r = y - 2; r <= y + 2; r++) {
+        const uint64_t *row = m->bits + (size_t)r * m->words;
+        uint64_t near = row[t] | (t > 0 ? row[t - 1] >> 62 : 0) | (t + 1 < m->words ? row[t + 1] << 62 : 0);
+        if (near) return 0;
+    }
+    return 1;
+}
+
+// one row of the float kernels. without maps it is a single span, otherwise it
+// goes tile by tile: tiles uniform in both maps are a span with their own
+// constants, mixed tiles first expand the maps into k and d per cell so the
+// stencil loop itself stays plain vector loads. lanes, when given, get the
+// energy and peak of the row as written
+static void step_row(const FluidGrid *fluid, int y, mask_row_t *restrict out, const mask_row_t *up,
+                     const mask_row_t *mid, const mask_row_t *down, StatLanes *lanes) {
+    const SpeedMap *speed = fluid->speed && fluid->speed->rows[y] ? fluid->speed : NULL;
+    const DampingMap *damp = fluid->damping_map && fluid->damping_map->rows[y] ? fluid->damping_map : NULL;
+    const calc_t d = fluid->damping;
+    const int velocity = fluid->damping_model == DAMPING_VELOCITY;
+#if FLUID_STENCIL == STENCIL_13
+    // the rows next to the edges keep the cross, and so do the tiles whose wide
+    // stencil would reach a solid cell, mask_row's mirrors assume the cross
+    const int wide = y >= 2 && y < GRID_HEIGHT - 2;
+    const ObstacleMask *solid = wide && fluid->obstacles && fluid->obstacles->rows[y] ? fluid->obstacles : NULL;
+#else
+    const int wide = 0;
+    const ObstacleMask *solid = NULL;
+#endif
+    int tiles = (GRID_WIDTH + MAP_TILE - 1) / MAP_TILE;
+
+    if (!speed && !damp) {
+        if (!solid) {
+            step_tile(out, up, mid, down, 1, GRID_WIDTH - 1, (calc_t)0.25, d, NULL, NULL, velocity, wide, lanes);
+            return;
+        }
+        // runs of tiles with the same form
+        for (int t = 0, u; t < tiles; t = u) {
+            int form = wide_tile(solid, y, t);
+            for (u = t + 1; u < tiles && wide_tile(solid, y, u) == form; u++) {}
+            int x0 = t * MAP_TILE < 1 ? 1 : t * MAP_TILE;
+            int x1 = u * MAP_TILE < GRID_WIDTH - 1 ? u * MAP_TILE : GRID_WIDTH - 1;
+            step_tile(out, up, mid, down, x0, x1, (calc_t)0.25, d, NULL, NULL, velocity, form, lanes);
+        }
+        return;
+    }
+
+    size_t row = (size_t)y * GRID_WIDTH;
+    for (int t = 0; t < tiles; t++) {
+        int x0 = t * MAP_TILE < 1 ? 1 : t * MAP_TILE;
+        int x1 = (t + 1) * MAP_TILE < GRID_WIDTH - 1 ? (t + 1) * MAP_TILE : GRID_WIDTH - 1;
+        int form = wide && (!solid || wide_tile(solid, y, t));
+        int st = speed ? speed->tile[(size_t)y * tiles + t] : SPEED_BASE;
+        int dt = damp ? damp->tile[(size_t)y * tiles + t] : 0;
+        calc_t k = st * ((calc_t)1 / 512);
+        calc_t dk = dt == 0 || dt == MAP_MIXED ? d : d * damp->factor[dt];
+
+        if (st != MAP_MIXED && dt != MAP_MIXED) {
+            step_tile(out, up, mid, down, x0, x1, k, dk, NULL, NULL, velocity, form, lanes);
+            continue;
+        }
+
+        calc_t kx[MAP_TILE], dx[MAP_TILE];
+        int n = x1 - x0;
+        if (st == MAP_MIXED) {
+            const uint8_t *q = speed->q + row + x0;
+            for (int i = 0; i < n; i++) kx[i] = q[i] * ((calc_t)1 / 512);
+        } else {
+            for (int i = 0; i < n; i++) kx[i] = k;
+        }
+        if (dt == MAP_MIXED) {
+            // factor[] worked out in place, a table lookup would be a gather
+            const uint8_t *q = damp->q + row + x0;
+            const float slope = damp->loss / 255.0f;
+            for (int i = 0; i < n; i++) dx[i] = d * (1.0f - slope * q[i]);
+        } else {
+            for (int i = 0; i < n; i++) dx[i] = dk;
+        }
+        step_tile(out, up, mid, down, x0, x1, 0, 0, kx, dx, velocity, form, lanes);
+    }
+}
+#endif
+
+// word w of a mask row with the bits of x = 0 and GRID_WIDTH - 1 set to first and last
+static inline uint64_t edge_word(const uint64_t *row, int w, uint64_t first, uint64_t last) {
+    uint64_t v = row[w];
+    if (w == 0) v = (v & ~(uint64_t)1) | first;
+    if (w == (GRID_WIDTH - 1) >> 6) {
+        int b = (GRID_WIDTH - 1) & 63;
+        v = (v & ~((uint64_t)1 << b)) | last << b;
+    }
+    return v;
+}
+
+// obstacles, applied to a row the kernel has just stepped. solid cells are zero,
+// so the kernel's laplacian already holds 0 for each solid neighbour. a mirror
+// wants the centre value there instead, so the fix is k * c * 0.25 * damping
+// for k solid neighbours, with the cell's own coefficient and damping when maps
+// set them. no need for the overwritten older value. 64 cells at a time: words
+// with nothing solid around them are skipped, the rest go through bit masks
+// and multiplies without branches
+static void mask_row(const FluidGrid *fluid, int y, mask_row_t *restrict out, const mask_row_t *restrict mid) {
+    const ObstacleMask *m = fluid->obstacles;
+    if (!masked_row(fluid, y)) return;
+
+    const uint64_t *row = m->bits + (size_t)y * m->words;
+    const uint64_t *up = row - m->words, *down = row + m->words;
+
+    // periodic edges: the halo holds copies of the far interior, so its bits
+    // come from there too. the rows next to the seam look across it, and x = 0
+    // and GRID_WIDTH - 1 stand for GRID_WIDTH - 2 and 1
+    uint64_t first = obstacle_at(m, 0, y), last = obstacle_at(m, GRID_WIDTH - 1, y);
+    if (fluid->boundary.mode == BOUNDARY_PERIODIC) {
+        if (y == 1) up = m->bits + (size_t)(GRID_HEIGHT - 2) * m->words;
+        if (y == GRID_HEIGHT - 2) down = m->bits + m->words;
+        first = obstacle_at(m, GRID_WIDTH - 2, y);
+        last = obstacle_at(m, 1, y);
+    }
+    const uint8_t *q = fluid->speed ? fluid->speed->q + (size_t)y * GRID_WIDTH : NULL;
+    const uint8_t *dq = damping_row(fluid, y);
+#if FLUID_STORAGE == FLUID_KAHAN
+    float *lo = fluid->current_lo + (size_t)y * GRID_WIDTH;
+#endif
+
+    for (int w = 0; w < m->words; w++) {
+        uint64_t solid = edge_word(row, w, first, last);
+        uint64_t left = solid << 1 | (w > 0 ? edge_word(row, w - 1, first, last) >> 63 : 0);   // x - 1 is solid
+        uint64_t right = solid >> 1 |                                                           // x + 1 is solid
+                         (w + 1 < m->words ? edge_word(row, w + 1, first, last) << 63 : 0);
+        if (!(solid | left | right | up[w] | down[w])) continue;
+
+        int x0 = w * 64;
+        int i0 = x0 < 1 ? 1 - x0 : 0;
+        int i1 = GRID_WIDTH - 1 - x0 < 64 ? GRID_WIDTH - 1 - x0 : 64;
+        for (int i = i0; i < i1; i++) {
+            int x = x0 + i;
+            int k = (int)((left >> i) & 1) + (int)((right >> i) & 1) +
+                    (int)((up[w] >> i) & 1) + (int)((down[w] >> i) & 1);
+            calc_t water = (calc_t)(1 - (int)((solid >> i) & 1));
+            calc_t g = (q ? q[x] * ((calc_t)1 / 512) : (calc_t)0.25) * laplacian_damping(fluid, dq, x);
+            out[x] = MASK_STORE((MASK_LOAD(out[x]) + g * k * MASK_LOAD(mid[x])) * water);
+#if FLUID_STORAGE == FLUID_KAHAN
+            lo[x] *= water;
+#endif
+        }
+    }
+}
+
+#if FLUID_STORAGE == FLUID_INT16
+// damping is a q15 multiply like pmulhrsw, but truncating toward zero so
+// small ripples still decay instead of sticking
+static inline int32_t damp_q15(int32_t v, int32_t d) {
+    return (v * d + ((v >> 31) & 0x7FFF)) >> 15;
+}
+
+static inline int32_t to_q15(float d) {
+    int32_t q = (int32_t)lrintf(d * 32768.0f);
+    return q > 32767 ? 32767 : q;
+}
+
+// integer leapfrog with saturation. inlined with constant flags, so every
+// combination of model and damping map gets its own branch free loop. lanes
+// are filled strip by strip like step_span's
+static inline __attribute__((always_inline)) void int16_row(cell_t *restrict cur, const cell_t *restrict prev,
+                                                            int32_t damp, const uint8_t *dq,
+                                                            const int32_t *damp_map, int velocity,
+                                                            StatLanes *lanes) {
+    int strip = lanes ? STAT_STRIP : GRID_WIDTH;
+    for (int x0 = 1; x0 < GRID_WIDTH - 1; x0 += strip) {
+        int x1 = x0 + strip < GRID_WIDTH - 1 ? x0 + strip : GRID_WIDTH - 1;
+        for (int x = x0; x < x1; x++) {
+            int32_t c = prev[x];
+            int32_t laplacian = prev[x - 1] + prev[x + 1] +
+                                prev[x - GRID_WIDTH] + prev[x + GRID_WIDTH] - 4 * c;
+            int32_t d = dq ? damp_map[dq[x]] : damp;
+
+            if (velocity) {
+                cur[x] = (int16_t)fixed_saturate(c + damp_q15(c - cur[x], d) + ((laplacian + 2) >> 2));
+            } else {
+                int32_t v = fixed_saturate(2 * c - cur[x] + ((laplacian + 2) >> 2));
+                cur[x] = (int16_t)damp_q15(v, d);
+            }
+        }
+        if (lanes) stat_span(lanes, cur, x0, x1);
+    }
+}
+
+static void update_band(FluidGrid *fluid, int y0, int y1, BandStats *stats) {
+    int32_t damp = to_q15(fluid->damping);
+    int velocity = fluid->damping_model == DAMPING_VELOCITY;
+
+    // the damping map's factors, in q15 like damp
+    int32_t damp_map[256];
+    if (fluid->damping_map) {
+        for (int v = 0; v < 256; v++) damp_map[v] = to_q15(fluid->damping * fluid->damping_map->factor[v]);
+    }
+
+    StatLanes band = {{0}, {0}}, row;
+    for (int y = y0; y < y1; y++) {
+        cell_t *restrict cur = fluid->current + (size_t)y * GRID_WIDTH;
+        const cell_t *restrict prev = fluid->previous + (size_t)y * GRID_WIDTH;
+        const uint8_t *dq = damping_row(fluid, y);
+        StatLanes *lanes = stats ? row_lanes(fluid, &row, y) : NULL;
+
+        if (dq) {
+            if (velocity) int16_row(cur, prev, damp, dq, damp_map, 1, lanes);
+            else int16_row(cur, prev, damp, dq, damp_map, 0, lanes);
+        } else {
+            if (velocity) int16_row(cur, prev, damp, NULL, NULL, 1, lanes);
+            else int16_row(cur, prev, damp, NULL, NULL, 0, lanes);
+        }
+        if (fluid->speed) speed_row(fluid, y, cur, prev - GRID_WIDTH, prev, prev + GRID_WIDTH);
+        if (fluid->obstacles) mask_row(fluid, y, cur, prev);
+        if (stats) gather_row(fluid, stats, &band, lanes, cur, y);
+    }
+    if (stats) gather_band(stats, &band);
+}
+#elif defined(CELL_WIDENED)
+// narrow storage: widen a rolling window of three rows, compute in float32, narrow back
+static void update_band(FluidGrid *fluid, int y0, int y1, BandStats *stats) {
+    int t = band_thread();
+    assert(t < fluid->window_count);
+    float *window = fluid->windows + (size_t)t * 4 * GRID_WIDTH;
+
+    float *up = window;
+    float *mid = up + GRID_WIDTH;
+    float *down = mid + GRID_WIDTH;
+    float *out = down + GRID_WIDTH;
+
+    load_row(up, fluid->previous + (size_t)(y0 - 1) * GRID_WIDTH, GRID_WIDTH);
+    load_row(mid, fluid->previous + (size_t)y0 * GRID_WIDTH, GRID_WIDTH);
+
+    StatLanes band = {{0}, {0}}, row;
+    for (int y = y0; y < y1; y++) {
+        cell_t *cur = fluid->current + (size_t)y * GRID_WIDTH;
+        load_row(down, fluid->previous + (size_t)(y + 1) * GRID_WIDTH, GRID_WIDTH);
+        load_row(out, cur, GRID_WIDTH);
+
+        StatLanes *lanes = stats ? row_lanes(fluid, &row, y) : NULL;
+        step_row(fluid, y, out, up, mid, down, lanes);
+        if (fluid->obstacles) mask_row(fluid, y, out, mid);
+        store_row(cur + 1, out + 1, GRID_WIDTH - 2);
+        if (stats) gather_row(fluid, stats, &band, lanes, out, y);
+
+        float *temp = up;
+        up = mid;
+        mid = down;
+        down = temp;
+    }
+    if (stats) gather_band(stats, &band);
+}
+#elif FLUID_STORAGE == FLUID_KAHAN
+// rounding error of a * b given p = fl(a * b)
+static inline float product_error(float a, float b, float p) {
+#ifdef FP_FAST_FMAF
+    return fmaf(a, b, -p);
+#else
+    // dekker split, fmaf without hardware support is a slow libm call
+    float ca = 4097.0f * a, cb = 4097.0f * b;
+    float ah = ca - (ca - a), bh = cb - (cb - b);
+    float al = a - ah, bl = b - bh;
+    return ((ah * bh - p) + ah * bl + al * bh) + al * bl;
+#endif
+}
+
+// float32 leapfrog whose update terms are summed with two-sum error tracking,
+// the residue is carried to the next step in the lo buffers. inlined with
+// constant flags like the int16 rows
+static inline __attribute__((always_inline)) void kahan_row(float *restrict cur, float *restrict cur_lo,
+                                                            const float *restrict prev,
+                                                            const float *restrict prev_lo, float damping,
+                                                            const uint8_t *dq, const float *factor,
+                                                            int velocity, StatLanes *lanes) {
+    int strip = lanes ? STAT_STRIP : GRID_WIDTH;
+    for (int x0 = 1; x0 < GRID_WIDTH - 1; x0 += strip) {
+        int x1 = x0 + strip < GRID_WIDTH - 1 ? x0 + strip : GRID_WIDTH - 1;
+        for (int x = x0; x < x1; x++) {
+            float c = prev[x];
+            float laplacian = (prev[x - 1] + prev[x + 1]) +
+                              (prev[x - GRID_WIDTH] + prev[x + GRID_WIDTH]) - 4.0f * c;
+            float laplacian_lo = (prev_lo[x - 1] + prev_lo[x + 1]) +
+                                 (prev_lo[x - GRID_WIDTH] + prev_lo[x + GRID_WIDTH]) - 4.0f * prev_lo[x];
+            float d = dq ? damping * factor[dq[x]] : damping;
+
+            if (velocity) {
+                // two-sum of c and -old, the motion, then its damped product
+                float a = c;
+                float b = -cur[x];
+                float m = a + b;
+                float bb = m - a;
+                float m_lo = (a - (m - bb)) + (b - bb) + prev_lo[x] - cur_lo[x];
+                float md = m * d;
+                float err = product_error(m, d, md) + m_lo * d;
+
+                // two-sums of c, the damped motion and the laplacian term
+                float s = c + md;
+                bb = s - c;
+                err += (c - (s - bb)) + (md - bb);
+                float q = laplacian * 0.25f;
+                float s2 = s + q;
+                bb = s2 - s;
+                err += (s - (s2 - bb)) + (q - bb);
+                err += prev_lo[x] + laplacian_lo * 0.25f;
+
+                float v = s2 + err;
+                cur[x] = v;
+                cur_lo[x] = err - (v - s2);
+            } else {
+                // two-sum of 2c and -old
+                float a = 2.0f * c;
+                float b = -cur[x];
+                float s = a + b;
+                float bb = s - a;
+                float err = (a - (s - bb)) + (b - bb);
+
+                // two-sum of that and the laplacian term (x0.25 is exact)
+                float q = laplacian * 0.25f;
+                float s2 = s + q;
+                bb = s2 - s;
+                err += (s - (s2 - bb)) + (q - bb);
+
+                // residues from the previous step
+                err += 2.0f * prev_lo[x] - cur_lo[x] + laplacian_lo * 0.25f;
+
+                float v = s2 + err;
+                float v_lo = err - (v - s2);
+
+                float hi = v * d;
+                cur[x] = hi;
+                cur_lo[x] = product_error(v, d, hi) + v_lo * d;
+            }
+        }
+        if (lanes) stat_span(lanes, cur, x0, x1);
+    }
+}
+
+static void update_band(FluidGrid *fluid, int y0, int y1, BandStats *stats) {
+    const float damping = fluid->damping;
+    const float *factor = fluid->damping_map ? fluid->damping_map->factor : NULL;
+    const int velocity = fluid->damping_model == DAMPING_VELOCITY;
+
+    StatLanes band = {{0}, {0}}, lanes_row;
+    for (int y = y0; y < y1; y++) {
+        size_t row = (size_t)y * GRID_WIDTH;
+        float *restrict cur = fluid->current + row;
+        float *restrict cur_lo = fluid->current_lo + row;
+        const float *restrict prev = fluid->previous + row;
+        const float *restrict prev_lo = fluid->previous_lo + row;
+        const uint8_t *dq = damping_row(fluid, y);
+        StatLanes *lanes = stats ? row_lanes(fluid, &lanes_row, y) : NULL;
+
+        if (dq) {
+            if (velocity) kahan_row(cur, cur_lo, prev, prev_lo, damping, dq, factor, 1, lanes);
+            else kahan_row(cur, cur_lo, prev, prev_lo, damping, dq, factor, 0, lanes);
+        } else {
+            if (velocity) kahan_row(cur, cur_lo, prev, prev_lo, damping, NULL, NULL, 1, lanes);
+            else kahan_row(cur, cur_lo, prev, prev_lo, damping, NULL, NULL, 0, lanes);
+        }
+        if (fluid->speed) speed_row(fluid, y, cur, prev - GRID_WIDTH, prev, prev + GRID_WIDTH);
+        if (fluid->obstacles) mask_row(fluid, y, cur, prev);
+        if (stats) gather_row(fluid, stats, &band, lanes, cur, y);
+    }
+    if (stats) gather_band(stats, &band);
+}
+#else
+// simd memory, calc_t is float or double depending on storage
+static void update_band(FluidGrid *fluid, int y0, int y1, BandStats *stats) {
+    StatLanes band = {{0}, {0}}, row;
+    for (int y = y0; y < y1; y++) {
+        cell_t *restrict cur = fluid->current + (size_t)y * GRID_WIDTH;
+        const cell_t *restrict prev = fluid->previous + (size_t)y * GRID_WIDTH;
+        StatLanes *lanes = stats ? row_lanes(fluid, &row, y) : NULL;
+
+        step_row(fluid, y, cur, prev - GRID_WIDTH, prev, prev + GRID_WIDTH, lanes);
+        if (fluid->obstacles) mask_row(fluid, y, cur, prev);
+        if (stats) gather_row(fluid, stats, &band, lanes, cur, y);
+    }
+    if (stats) gather_band(stats, &band);
+}
+#endif
+
+// file-backed grids: ask the kernel to start reading a band's rows before the sweep reaches them
+static void prefetch_rows(const FluidGrid *fluid, int y0, int y1) {
+    if (y0 < 0) y0 = 0;
+    if (y1 > GRID_HEIGHT) y1 = GRID_HEIGHT;
+    if (y0 >= y1) return;
+
+    size_t row_bytes = GRID_WIDTH * sizeof(cell_t);
+    const void *arrays[] = { fluid->previous, fluid->current };
+    for (int i = 0; i < 2; i++) {
+        uintptr_t start = (uintptr_t)arrays[i] + y0 * row_bytes;
+        uintptr_t end = start + (y1 - y0) * row_bytes;
+        start &= ~(uintptr_t)(CHECKPOINT_ALIGN - 1);
+        madvise((void *)start, end - start, MADV_WILLNEED);
+    }
+}
+
+// periodic halos copy the cells next to each edge into the opposite edge, so
+// a box reaching an edge's inner neighbour also covers the far edge
+static void wrap_views(FieldStats *stats) {
+    for (int b = 0; b < GRID_BANDS; b++) {
+        BandStats *v = &stats->view[b];
+        if (v->x1 < v->x0) continue;
+        if (v->x0 <= 1) v->x1 = GRID_WIDTH - 1;
+        if (v->x1 >= GRID_WIDTH - 2) v->x0 = 0;
+    }
+
+    BandStats *top = &stats->view[0], *bottom = &stats->view[GRID_BANDS - 1];
+    BandStats to_top, to_bottom;
+    clear_band_stats(&to_top);
+    clear_band_stats(&to_bottom);
+    if (bottom->x0 <= bottom->x1 && bottom->y1 >= GRID_HEIGHT - 2) {
+        to_top.x0 = bottom->x0;
+        to_top.x1 = bottom->x1;
+        to_top.y0 = to_top.y1 = 0;
+    }
+    if (top->x0 <= top->x1 && top->y0 <= 1) {
+        to_bottom.x0 = top->x0;
+        to_bottom.x1 = top->x1;
+        to_bottom.y0 = to_bottom.y1 = GRID_HEIGHT - 1;
+    }
+    merge_band_stats(top, &to_top);
+    merge_band_stats(bottom, &to_bottom);
+}
+
+// the field that ends up on screen after this step is the one going in, as
+// of the last step's stats plus whatever was injected since
+static void view_boxes(FluidGrid *fluid, FieldStats *stats) {
+    // emitters write every step, their rows are close enough
+    const EmitterSet *set = &fluid->emitters;
+    if (set->count > 0) {
+        int64_t lo = set->cell[0], hi = set->cell[0];
+        for (int i = 1; i < set->count; i++) {
+            lo = set->cell[i] < lo ? set->cell[i] : lo;
+            hi = set->cell[i] > hi ? set->cell[i] : hi;
+        }
+        touch_cells(fluid, 0, (int)(lo / GRID_WIDTH), GRID_WIDTH - 1, (int)(hi / GRID_WIDTH));
+    }
+
+    // the stats of the step before are only valid if there was one, and its
+    // boxes only if it gathered them
+    if (stats->step != fluid->step || stats->level < STATS_BOXES) {
+        for (int b = 0; b < GRID_BANDS; b++) clear_band_stats(&stats->band[b]);
+        touch_all(fluid);
+    }
+
+    for (int b = 0; b < GRID_BANDS; b++) {
+        BandStats *view = &stats->view[b];
+        *view = stats->band[b];
+        int y0 = 1 + b * BAND_ROWS;
+        int y1 = y0 + BAND_ROWS - 1 < GRID_HEIGHT - 2 ? y0 + BAND_ROWS - 1 : GRID_HEIGHT - 2;
+        if (fluid->touch_x1 < fluid->touch_x0 || fluid->touch_y1 < y0 || fluid->touch_y0 > y1) continue;
+
+        BandStats touched;
+        clear_band_stats(&touched);
+        touched.x0 = fluid->touch_x0;
+        touched.x1 = fluid->touch_x1;
+        touched.y0 = fluid->touch_y0 > y0 ? fluid->touch_y0 : y0;
+        touched.y1 = fluid->touch_y1 < y1 ? fluid->touch_y1 : y1;
+        merge_band_stats(view, &touched);
+    }
+    fluid->touch_x0 = fluid->touch_y0 = INT32_MAX;
+    fluid->touch_x1 = fluid->touch_y1 = -1;
+
+    if (fluid->boundary.mode == BOUNDARY_PERIODIC) wrap_views(stats);
+}
+
+// nothing visible is left: zero both time levels exactly so the next steps
+// have no denormal tails to chew on, and stop stepping
+static void settle_fluid(FluidGrid *fluid) {
+    memset(fluid->current, 0, GRID_CELLS * sizeof(cell_t));
+    memset(fluid->previous, 0, GRID_CELLS * sizeof(cell_t));
+#if FLUID_STORAGE == FLUID_KAHAN
+    memset(fluid->current_lo, 0, GRID_CELLS * sizeof(float));
+    memset(fluid->previous_lo, 0, GRID_CELLS * sizeof(float));
+#endif
+    fluid->quiet_steps = 0;
+    fluid->idle = 1;
+}
+
+// mur's discretization of u_t = c u_n at edge cell e with inner neighbour i.
+// courant number c = 0.5 (the 0.25 in the kernels is its square), so
+// (c - 1) / (c + 1) = -1/3. current holds the new interior and the edges'
+// values from two steps back, previous the step in between. with a speed map
+// the edge cell's own coefficient picks the value from the map's table
+#define MUR_K (-1.0f / 3.0f)
+
+static inline void open_edge(FluidGrid *fluid, size_t e, size_t i) {
+    float k = fluid->speed ? fluid->speed->mur[fluid->speed->q[e]] : MUR_K;
+    float v = CELL_LOAD(fluid->previous[i]) +
+              k * (CELL_LOAD(fluid->current[i]) - CELL_LOAD(fluid->previous[e]));
+    fluid->current[e] = CELL_STORE(v);
+#if FLUID_STORAGE == FLUID_KAHAN
+    fluid->current_lo[e] = 0.0f;
+#endif
+}
+
+// damps this step's change rather than the height, so the sponge takes energy
+// out of waves without pulling the water level toward zero. damping the height
+// changes how the band responds to long waves enough that it reflects them
+static inline void sponge_cell(FluidGrid *fluid, size_t idx, float factor) {
+    float before = CELL_LOAD(fluid->previous[idx]);
+    fluid->current[idx] = CELL_STORE(before + (CELL_LOAD(fluid->current[idx]) - before) * factor);
+#if FLUID_STORAGE == FLUID_KAHAN
+    fluid->current_lo[idx] = fluid->previous_lo[idx] + (fluid->current_lo[idx] - fluid->previous_lo[idx]) * factor;
+#endif
+}
+
+// the kernels' stats only cover the interior columns
+static inline void cell_stats(BandStats *s, float v, int x, int y, float threshold) {
+    float a = fabsf(v);
+    if (a > 1e-18f) s->energy += a * a;
+    if (a > s->peak) s->peak = a;
+    if (!(a > threshold)) return;
+    s->active++;
+    if (x < s->x0) s->x0 = x;
+    if (x > s->x1) s->x1 = x;
+    if (y < s->y0) s->y0 = y;
+    if (y > s->y1) s->y1 = y;
+}
+
+static void edge_row(FluidGrid *fluid, int y, int inner, BandStats *stats) {
+    size_t row = (size_t)y * GRID_WIDTH, in = (size_t)inner * GRID_WIDTH;
+    for (int x = 0; x < GRID_WIDTH; x++) open_edge(fluid, row + x, in + x);
+    if (!stats) return;
+    for (int x = 0; x < GRID_WIDTH; x++)
+        cell_stats(stats, CELL_LOAD(fluid->current[row + x]), x, y, fluid->stats->threshold);
+}
+
+// runs on a band right after the kernel, while its rows are still in cache.
+// the sponge goes first, so the edges see the damped neighbours. the kernels
+// left the sponge cells out of the stats (stat_margin), they go in as damped
+static void boundary_band(FluidGrid *fluid, int y0, int y1, BandStats *stats) {
+    const Boundary *b = &fluid->boundary;
+    int w = b->mode == BOUNDARY_SPONGE ? b->width : 0;
+    float threshold = stats ? fluid->stats->threshold : 0.0f;
+
+    for (int y = y0; y < y1; y++) {
+        size_t row = (size_t)y * GRID_WIDTH;
+        int dy = y < GRID_HEIGHT - 1 - y ? y : GRID_HEIGHT - 1 - y;
+        if (dy < w) {
+            for (int x = 1; x < GRID_WIDTH - 1; x++) {
+                int d = x < GRID_WIDTH - 1 - x ? x : GRID_WIDTH - 1 - x;
+                sponge_cell(fluid, row + x, b->factor[d < dy ? d : dy]);
+            }
+            // whole rows take the vector pass where the stats read the stored cells
+            if (stats) {
+#ifdef CELL_WIDENED
+                for (int x = 1; x < GRID_WIDTH - 1; x++)
+                    cell_stats(stats, CELL_LOAD(fluid->current[row + x]), x, y, threshold);
+#else
+                row_stats(stats, fluid->current + row, y, threshold, 1, GRID_WIDTH - 1);
+#endif
+            }
+        } else {
+            for (int d = 1; d < w; d++) {
+                size_t left = row + d, right = row + GRID_WIDTH - 1 - d;
+                sponge_cell(fluid, left, b->factor[d]);
+                sponge_cell(fluid, right, b->factor[d]);
+                if (stats) {
+                    cell_stats(stats, CELL_LOAD(fluid->current[left]), d, y, threshold);
+                    cell_stats(stats, CELL_LOAD(fluid->current[right]), GRID_WIDTH - 1 - d, y, threshold);
+                }
+            }
+        }
+
+        open_edge(fluid, row, row + 1);
+        open_edge(fluid, row + GRID_WIDTH - 1, row + GRID_WIDTH - 2);
+        if (stats) {
+            cell_stats(stats, CELL_LOAD(fluid->current[row]), 0, y, threshold);
+            cell_stats(stats, CELL_LOAD(fluid->current[row + GRID_WIDTH - 1]), GRID_WIDTH - 1, y, threshold);
+        }
+    }
+
+    // the top and bottom edges, corners included, once their inner rows are done
+    if (y0 == 1) edge_row(fluid, 0, 1, stats);
+    if (y1 == GRID_HEIGHT - 1) edge_row(fluid, GRID_HEIGHT - 1, GRID_HEIGHT - 2, stats);
+}
+
+// periodic edges: the outer ring holds copies of the opposite interior rows and
+// columns (period GRID_WIDTH - 2 by GRID_HEIGHT - 2). refreshing it before a step
+// is two row copies and two cells per row, and the kernels read across the
+// seam with no wrap logic of their own
+static void refresh_halo(cell_t *g) {
+    size_t row_bytes = GRID_WIDTH * sizeof(cell_t);
+    memcpy(g, g + (size_t)(GRID_HEIGHT - 2) * GRID_WIDTH, row_bytes);
+    memcpy(g + (size_t)(GRID_HEIGHT - 1) * GRID_WIDTH, g + GRID_WIDTH, row_bytes);
+
+    // after the rows, so the corners come out right too
+    for (int y = 0; y < GRID_HEIGHT; y++) {
+        cell_t *row = g + (size_t)y * GRID_WIDTH;
+        row[0] = row[GRID_WIDTH - 2];
+        row[GRID_WIDTH - 1] = row[1];
+    }
+}
+
+// one driver for every storage: rows are cut into bands and spread over threads
+void update_fluid(FluidGrid *fluid) {
+    if (fluid->idle) return;
+    apply_emitters(fluid);
+
+    int mode = fluid->boundary.mode;
+    if (mode == BOUNDARY_PERIODIC) {
+        refresh_halo(fluid->previous);
+#if FLUID_STORAGE == FLUID_KAHAN
+        refresh_halo(fluid->previous_lo);
+#endif
+    }
+
+    // inside grid
+    FieldStats *stats = fluid->stats;
+    if (stats) {
+        view_boxes(fluid, stats);
+        uint64_t next = fluid->step + 1;
+        if (stats->count_every > 0 && next % stats->count_every == 0) stats->level = STATS_COUNT;
+        else if (stats->boxes) stats->level = STATS_BOXES;
+        else if (stats->idle_after > 0 && next % IDLE_CHECK == 0) stats->level = STATS_ENERGY;
+        else stats->level = STATS_NONE;
+    }
+    if (stats && stats->level == STATS_NONE) stats = NULL;
+
+    // every thread sweeps a contiguous run of bands, so a backed grid can have
+    // the thread's own next band read in while it steps the current one
+    #pragma omp parallel
+    {
+        int t = band_thread(), team = band_team();
+        int b0 = GRID_BANDS * t / team, b1 = GRID_BANDS * (t + 1) / team;
+        for (int b = b0; b < b1; b++) {
+            int y0 = 1 + b * BAND_ROWS;
+            int y1 = y0 + BAND_ROWS < GRID_HEIGHT - 1 ? y0 + BAND_ROWS : GRID_HEIGHT - 1;
+            if (fluid->backing && b + 1 < b1) prefetch_rows(fluid, y1, y1 + BAND_ROWS + 1);
+            BandStats *band = NULL;
+            if (stats) {
+                band = &stats->band[b];
+                clear_band_stats(band);
+            }
+            update_band(fluid, y0, y1, band);
+            if (mode == BOUNDARY_OPEN || mode == BOUNDARY_SPONGE) boundary_band(fluid, y0, y1, band);
+        }
+    }
+
+    // each thread filled its own bands, reduce them in order so totals repeat exactly
+    if (stats) {
+        clear_band_stats(&stats->total);
+        for (int b = 0; b < GRID_BANDS; b++) merge_band_stats(&stats->total, &stats->band[b]);
+        stats->step = fluid->step + 1;
+
+        // emitters keep driving the field, so a grid with any never settles.
+        // a sampled check stands for the steps since the one before
+        if (stats->idle_after > 0 && stats->total.energy < stats->idle_energy &&
+            fluid->emitters.count == 0) {
+            fluid->quiet_steps += stats->level == STATS_ENERGY ? IDLE_CHECK : 1;
+        } else {
+            fluid->quiet_steps = 0;
+        }
+    }
+    
+    // buffers 
+    cell_t *temp = fluid->current;
+    fluid->current = fluid->previous;
+    fluid->previous = temp;
+#if FLUID_STORAGE == FLUID_KAHAN
+    float *temp_lo = fluid->current_lo;
+    fluid->current_lo = fluid->previous_lo;
+    fluid->previous_lo = temp_lo;
+#endif
+    fluid->step++;
+
+    if (fluid->backing) {
+        uint8_t *base = fluid->mapping;
+        fluid->backing->current_offset = (uint8_t *)fluid->current - base;
+        fluid->backing->previous_offset = (uint8_t *)fluid->previous - base;
+#if FLUID_STORAGE == FLUID_KAHAN
+        fluid->backing->current_lo_offset = (uint8_t *)fluid->current_lo - base;
+        fluid->backing->previous_lo_offset = (uint8_t *)fluid->previous_lo - base;
+#endif
+        fluid->backing->step = fluid->step;
+        fluid->backing->damping = fluid->damping;
+        fluid->backing->damping_model = fluid->damping_model;
+    }
+
+    if (fluid->probes) sample_probes(fluid->probes, fluid);
+    if (stats && stats->idle_after > 0 && fluid->quiet_steps >= stats->idle_after) settle_fluid(fluid);
+}
+
+void add_disturbance(FluidGrid *fluid, int x, int y, float intensity) {
+    if (x >= 1 && x < GRID_WIDTH - 1 && y >= 1 && y < GRID_HEIGHT - 1 &&
+        !(fluid->obstacles && obstacle_at(fluid->obstacles, x, y))) {
+        size_t idx = (size_t)y * GRID_WIDTH + x;
+        fluid->previous[idx] = CELL_STORE(CELL_LOAD(fluid->previous[idx]) + intensity);
+        fluid->idle = 0;
+        touch_cells(fluid, x, y, x, y);
+    }
+}
+
+void add_continuous_wave(FluidGrid *fluid, int x1, int y1, int x2, int y2, float intensity) {
+    // 2 poitns
+    float dx = x2 - x1;
+    float dy = y2 - y1;
+    float distance = sqrtf(dx*dx + dy*dy);
+    
+    if (distance < 1.0f) {
+        add_disturbance(fluid, x1, y1, intensity);
+        return;
+    }
+    
+    //pre calculation 
+    int steps = (int)(distance * 1.5f) + 1;
+    float inv_steps = 1.0f / steps;
+    
+    for (int i = 0; i <= steps; i++) {
+        float t = i * inv_steps;
+        int cx = (int)(x1 + dx * t);
+        int cy = (int)(y1 + dy * t);
+        float current_intensity = intensity * (1.0f - t * 0.3f);
+        
+        // smaller radius
+        if (cx >= 2 && cx < GRID_WIDTH - 2 && cy >= 2 && cy < GRID_HEIGHT - 2) {
+            add_disturbance(fluid, cx, cy, current_intensity);
+        }
+    }
+}
+
+// realestic distrubince
+void add_water_drop(FluidGrid *fluid, int x, int y, float intensity) {
+    if (x >= 3 && x < GRID_WIDTH - 3 && y >= 3 && y < GRID_HEIGHT - 3) {
+        // Create a realistic water drop pattern
+        for (int dy = -3; dy <= 3; dy++) {
+            for (int dx = -3; dx <= 3; dx++) {
+                float dist = sqrtf(dx*dx + dy*dy);
+                if (dist <= 3.0f) {
+                    // gaus distrurbiacne 
+                    float falloff = expf(-dist * dist * 0.3f);
+                    float wave = cosf(dist * 1.5f) * falloff;
+                    add_disturbance(fluid, x + dx, y + dy, intensity * wave);
+                }
+            }
+        }
+    }
+}
+
+// xorshift64*, own generator so runs don't depend on libc rand()
+uint64_t storm_next(Storm *storm) {
+    storm->rng ^= storm->rng >> 12;
+    storm->rng ^= storm->rng << 25;
+    storm->rng ^= storm->rng >> 27;
+    return storm->rng * 0x2545F4914F6CDD1DULL;
+}
+
+float storm_uniform(Storm *storm) {
+    return (storm_next(storm) >> 40) * (1.0f / 16777216.0f);
+}
+
+int storm_poisson(Storm *storm, float mean) {
+    if (mean <= 0.0f) return 0;
+
+    // knuth for small rates
+    if (mean < 30.0f) {
+        float limit = expf(-mean);
+        float p = storm_uniform(storm);
+        int k = 0;
+        while (p > limit) {
+            p *= storm_uniform(storm);
+            k++;
+        }
+        return k;
+    }
+
+    // normal approximation for thousands of drops per frame
+    float u1 = fmaxf(storm_uniform(storm), 1e-7f);
+    float u2 = storm_uniform(storm);
+    float n = sqrtf(-2.0f * logf(u1)) * cosf(6.2831853f * u2);
+    int k = (int)(mean + sqrtf(mean) * n + 0.5f);
+    return k > 0 ? k : 0;
+}
+
+void init_storm(Storm *storm, const StormConfig *config) {
+    memset(storm, 0, sizeof(*storm));
+    storm->config = *config;
+    if (storm->config.boats > STORM_MAX_BOATS) storm->config.boats = STORM_MAX_BOATS;
+
+    // zero state would lock xorshift
+    storm->rng = config->seed * 0x9E3779B97F4A7C15ULL + 1;
+
+    for (int i = 0; i < storm->config.boats; i++) {
+        float angle = storm_uniform(storm) * 6.2831853f;
+        storm->boat_x[i] = 4 + storm_uniform(storm) * (GRID_WIDTH - 8);
+        storm->boat_y[i] = 4 + storm_uniform(storm) * (GRID_HEIGHT - 8);
+        storm->boat_dx[i] = cosf(angle) * storm->config.boat_speed;
+        storm->boat_dy[i] = sinf(angle) * storm->config.boat_speed;
+    }
+}
+
+void storm_step(Storm *storm, FluidGrid *fluid) {
+    const StormConfig *cfg = &storm->config;
+
+    // raindrops
+    int drops = storm_poisson(storm, cfg->rain_rate);
+    for (int i = 0; i < drops; i++) {
+        int x = 3 + (int)(storm_uniform(storm) * (GRID_WIDTH - 6));
+        int y = 3 + (int)(storm_uniform(storm) * (GRID_HEIGHT - 6));
+        float intensity = cfg->rain_intensity * (0.5f + storm_uniform(storm));
+        add_water_drop(fluid, x, y, intensity);
+    }
+    storm->drops += drops;
+
+    // boats drag a line source along their path, bouncing off the edges
+    for (int i = 0; i < cfg->boats; i++) {
+        float x = storm->boat_x[i];
+        float y = storm->boat_y[i];
+        float nx = x + storm->boat_dx[i];
+        float ny = y + storm->boat_dy[i];
+
+        if (nx < 4 || nx > GRID_WIDTH - 5) {
+            storm->boat_dx[i] = -storm->boat_dx[i];
+            nx = x;
+        }
+        if (ny < 4 || ny > GRID_HEIGHT - 5) {
+            storm->boat_dy[i] = -storm->boat_dy[i];
+            ny = y;
+        }
+
+        add_continuous_wave(fluid, (int)x, (int)y, (int)nx, (int)ny, cfg->boat_intensity);
+        storm->boat_x[i] = nx;
+        storm->boat_y[i] = ny;
+    }
+
+    // wave makers drive a sine along the boundary edges
+    if (cfg->wave_makers > 0 && cfg->wave_period > 0) {
+        float phase = 6.2831853f * (storm->frame % cfg->wave_period) / cfg->wave_period;
+        float intensity = cfg->wave_intensity * sinf(phase);
+
+        add_continuous_wave(fluid, 2, 2, 2, GRID_HEIGHT - 3, intensity);
+        if (cfg->wave_makers > 1)
+            add_continuous_wave(fluid, GRID_WIDTH - 3, 2, GRID_WIDTH - 3, GRID_HEIGHT - 3, intensity);
+        if (cfg->wave_makers > 2)
+            add_continuous_wave(fluid, 2, 2, GRID_WIDTH - 3, 2, intensity);
+        if (cfg->wave_makers > 3)
+            add_continuous_wave(fluid, 2, GRID_HEIGHT - 3, GRID_WIDTH - 3, GRID_HEIGHT - 3, intensity);
+    }
+
+    storm->frame++;
+}
+
+// frame codec: delta against a reference frame, zigzag, then per block a zero-run
+// length plus rice code. floats are either error-bounded quantized (lossy) or their
+// bits are mapped to ordered integers and delta coded exactly (lossless)
+#define CODEC_BLOCK 4096
+#define CODEC_RAW_BLOCK 31      // rice parameter marking a block stored verbatim
+#define CODEC_ESCAPE 24         // unary quotients this long are followed by the raw value
+#define CODEC_MAX_STEPS (1 << 23)
+// first symbol of a lossy block whose change is too large for CODEC_MAX_STEPS steps,
+// the block's exact float bits follow. clamped steps never code to it
+#define CODEC_EXACT_BLOCK (2ull * CODEC_MAX_STEPS + 1)
+
+// worst case encoded size for count words of width bytes, with room per block
+// for its header and an exact block's marker
+#define CODEC_BOUND(count, width) ((count) * (width) + ((count) / CODEC_BLOCK + 1) * 17 + CODEC_BLOCK * 12 + 64)
+
+typedef struct {
+    uint8_t *p;
+    uint64_t acc;
+    int bits;
+} BitWriter;
+
+typedef struct {
+    const uint8_t *p;
+    const uint8_t *end;
+    uint64_t acc;
+    int bits;
+    int pad;                    // zero bytes fed in past the end
+} BitReader;
+
+// n <= 32, bits go out lsb first
+static inline void put_bits(BitWriter *w, uint64_t v, int n) {
+    w->acc |= v << w->bits;
+    w->bits += n;
+    if (w->bits >= 32) {
+        uint32_t out = (uint32_t)w->acc;
+        memcpy(w->p, &out, 4);
+        w->p += 4;
+        w->acc >>= 32;
+        w->bits -= 32;
+    }
+}
+
+static inline void flush_bits(BitWriter *w) {
+    while (w->bits > 0) {
+        *w->p++ = (uint8_t)w->acc;
+        w->acc >>= 8;
+        w->bits -= 8;
+    }
+    w->bits = 0;
+    w->acc = 0;
+}
+
+static inline void refill_bits(BitReader *r) {
+    while (r->bits <= 56) {
+        uint64_t b = 0;
+        if (r->p < r->end) b = *r->p++;
+        else r->pad++;
+        r->acc |= b << r->bits;
+        r->bits += 8;
+    }
+}
+
+// n <= 32
+static inline uint64_t get_bits(BitReader *r, int n) {
+    refill_bits(r);
+    uint64_t v = r->acc & ((1ull << n) - 1);
+    r->acc >>= n;
+    r->bits -= n;
+    return v;
+}
+
+// q ones then a zero; long quotients escape to the raw 64 bit value
+static inline void put_rice(BitWriter *w, uint64_t v, int k) {
+    uint64_t q = v >> k;
+    if (q >= CODEC_ESCAPE) {
+        put_bits(w, (1u << CODEC_ESCAPE) - 1, CODEC_ESCAPE);
+        put_bits(w, (uint32_t)v, 32);
+        put_bits(w, v >> 32, 32);
+        return;
+    }
+    put_bits(w, (1u << q) - 1, (int)q + 1);
+    if (k) put_bits(w, v & ((1ull << k) - 1), k);
+}
+
+static inline uint64_t get_rice(BitReader *r, int k) {
+    refill_bits(r);
+    int q = ~r->acc ? __builtin_ctzll(~r->acc) : 64;
+    if (q >= CODEC_ESCAPE) {
+        get_bits(r, CODEC_ESCAPE);
+        uint64_t lo = get_bits(r, 32);
+        return lo | get_bits(r, 32) << 32;
+    }
+    r->acc >>= q + 1;
+    r->bits -= q + 1;
+    uint64_t v = (uint64_t)q << k;
+    if (k) v |= get_bits(r, k);
+    return v;
+}
+
+// run lengths: unary bit count, then the bits below the leading one
+static inline void put_run(BitWriter *w, uint32_t run) {
+    uint32_t x = run + 1;
+    int n = 31 - __builtin_clz(x);
+    put_bits(w, (1u << n) - 1, n + 1);
+    if (n) put_bits(w, x & ((1u << n) - 1), n);
+}
+
+static inline uint32_t get_run(BitReader *r) {
+    refill_bits(r);
+    int n = ~r->acc ? __builtin_ctzll(~r->acc) : 64;
+    if (n > 31) return UINT32_MAX;
+    r->acc >>= n + 1;
+    r->bits -= n + 1;
+    uint32_t x = 1u << n;
+    if (n) x |= (uint32_t)get_bits(r, n);
+    return x - 1;
+}
+
+static inline uint64_t zigzag(int64_t v) {
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t v) {
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+// one block of symbols: rice parameter from the mean nonzero magnitude, falls back
+// to raw sym_bits wide words when that is smaller
+static void encode_block(BitWriter *w, const uint64_t *sym, int n, int sym_bits) {
+    uint64_t sum = 0;
+    int nonzero = 0;
+    for (int i = 0; i < n; i++) {
+        if (sym[i]) {
+            uint64_t v = sym[i] - 1;
+            sum += v < (1ull << 40) ? v : (1ull << 40);
+            nonzero++;
+        }
+    }
+    int k = 0;
+    while (k < CODEC_RAW_BLOCK - 1 && ((uint64_t)nonzero << (k + 1)) <= sum) k++;
+
+    BitWriter start = *w;
+    put_bits(w, k, 5);
+    for (int i = 0; i < n;) {
+        int run = 0;
+        while (i + run < n && sym[i + run] == 0) run++;
+        put_run(w, run);
+        i += run;
+        if (i < n) put_rice(w, sym[i++] - 1, k);
+    }
+
+    size_t used = (size_t)(w->p - start.p) * 8 + w->bits - start.bits;
+    if (used > (size_t)n * sym_bits + 5) {
+        *w = start;
+        put_bits(w, CODEC_RAW_BLOCK, 5);
+        for (int i = 0; i < n; i++) {
+            if (sym_bits > 32) {
+                put_bits(w, (uint32_t)sym[i], 32);
+                put_bits(w, sym[i] >> 32, sym_bits - 32);
+            } else {
+                put_bits(w, sym[i], sym_bits);
+            }
+        }
+    }
+}
+
+static int decode_block(BitReader *r, uint64_t *sym, int n, int sym_bits) {
+    int k = (int)get_bits(r, 5);
+    if (k == CODEC_RAW_BLOCK) {
+        for (int i = 0; i < n; i++) {
+            if (sym_bits > 32) {
+                uint64_t lo = get_bits(r, 32);
+                sym[i] = lo | get_bits(r, sym_bits - 32) << 32;
+            } else {
+                sym[i] = get_bits(r, sym_bits);
+            }
+        }
+        return 1;
+    }
+    for (int i = 0; i < n;) {
+        uint32_t run = get_run(r);
+        if (run > (uint32_t)(n - i)) return 0;
+        memset(sym + i, 0, run * sizeof(uint64_t));
+        i += run;
+        if (i < n) sym[i++] = get_rice(r, k) + 1;
+    }
+    return 1;
+}
+
+// maps float bits to integers in the same order, so nearby values get small deltas
+static inline uint64_t word_load(const uint8_t *p, int width, int is_float) {
+    uint64_t u = 0;
+    memcpy(&u, p, width);
+    if (is_float) {
+        uint64_t top = 1ull << (width * 8 - 1);
+        uint64_t mask = top | (top - 1);
+        u = (u & top) ? ~u & mask : u | top;
+    }
+    return u;
+}
+
+static inline void word_store(uint8_t *p, uint64_t u, int width, int is_float) {
+    if (is_float) {
+        uint64_t top = 1ull << (width * 8 - 1);
+        uint64_t mask = top | (top - 1);
+        u = (u & top) ? u & ~top : ~u & mask;
+    }
+    memcpy(p, &u, width);
+}
+
+// sign extended difference of two width byte words
+static inline int64_t word_delta(uint64_t a, uint64_t b, int width) {
+    int shift = 64 - width * 8;
+    return (int64_t)((a - b) << shift) >> shift;
+}
+
+// lossless: count words of width 2, 4 or 8 bytes, delta coded against ref (NULL for none)
+size_t encode_words(const void *src, const void *ref, size_t count, int width, int is_float, uint8_t *dst) {
+    const uint8_t *s = src;
+    const uint8_t *r = ref;
+    uint64_t sym[CODEC_BLOCK];
+    BitWriter w = { dst, 0, 0 };
+
+    for (size_t base = 0; base < count; base += CODEC_BLOCK) {
+        int n = count - base < CODEC_BLOCK ? (int)(count - base) : CODEC_BLOCK;
+        for (int i = 0; i < n; i++) {
+            size_t off = (base + i) * width;
+            uint64_t a = word_load(s + off, width, is_float);
+            uint64_t b = r ? word_load(r + off, width, is_float) : 0;
+            sym[i] = zigzag(word_delta(a, b, width));
+        }
+        encode_block(&w, sym, n, width * 8);
+    }
+    flush_bits(&w);
+    return w.p - dst;
+}
+
+int decode_words(const uint8_t *src, size_t size, const void *ref, size_t count, int width, int is_float, void *dst) {
+    uint8_t *d = dst;
+    const uint8_t *r = ref;
+    uint64_t sym[CODEC_BLOCK];
+    BitReader reader = { src, src + size, 0, 0, 0 };
+
+    for (size_t base = 0; base < count; base += CODEC_BLOCK) {
+        int n = count - base < CODEC_BLOCK ? (int)(count - base) : CODEC_BLOCK;
+        if (!decode_block(&reader, sym, n, width * 8)) return 0;
+        for (int i = 0; i < n; i++) {
+            size_t off = (base + i) * width;
+            uint64_t b = r ? word_load(r + off, width, is_float) : 0;
+            word_store(d + off, b + (uint64_t)unzigzag(sym[i]), width, is_float);
+        }
+    }
+    return reader.pad * 8 <= reader.bits;
+}
+
+// quantizer step for an error bound: a power of two so recon + q * step rounds the
+// same way in the encoder and the decoder, fused or not
+static float codec_step(float error_bound) {
+    int e;
+    frexpf(2.0f * error_bound, &e);
+    return ldexpf(1.0f, e - 1);
+}
+
+// lossy when error_bound > 0: every value decodes within error_bound of src, plus
+// the rounding of one float add. recon is the decoder's previous frame (zeros for a
+// key frame) and is advanced to the new one. error_bound 0 codes the float bits exactly
+size_t encode_field(const float *src, float *recon, size_t count, float error_bound, uint8_t *dst) {
+    if (error_bound <= 0.0f) {
+        size_t n = encode_words(src, recon, count, sizeof(float), 1, dst);
+        memcpy(recon, src, count * sizeof(float));
+        return n;
+    }
+
+    float step = codec_step(error_bound);
+    float inv = 1.0f / step;
+    uint64_t sym[CODEC_BLOCK];
+    BitWriter w = { dst, 0, 0 };
+
+    for (size_t base = 0; base < count; base += CODEC_BLOCK) {
+        int n = count - base < CODEC_BLOCK ? (int)(count - base) : CODEC_BLOCK;
+        const float *s = src + base;
+        float *r = recon + base;
+        int fits = 1;
+        for (int i = 0; i < n && fits; i++) {
+            float q = rintf((s[i] - r[i]) * inv);
+            fits = fabsf(q) <= (float)CODEC_MAX_STEPS;   // false for nan too
+            sym[i] = fits ? zigzag((int64_t)q) : 0;
+        }
+        if (fits) {
+            for (int i = 0; i < n; i++) r[i] += (float)unzigzag(sym[i]) * step;
+            encode_block(&w, sym, n, 32);
+            continue;
+        }
+
+        // clamping would break the bound, so the block goes exactly, as float
+        // bit deltas against recon like the lossless path
+        memset(sym, 0, n * sizeof(sym[0]));
+        sym[0] = CODEC_EXACT_BLOCK;
+        encode_block(&w, sym, n, 32);
+        for (int i = 0; i < n; i++) {
+            uint64_t a = word_load((const uint8_t *)(s + i), 4, 1);
+            uint64_t b = word_load((const uint8_t *)(r + i), 4, 1);
+            sym[i] = zigzag(word_delta(a, b, 4));
+            r[i] = s[i];
+        }
+        encode_block(&w, sym, n, 32);
+    }
+    flush_bits(&w);
+    return w.p - dst;
+}
+
+int decode_field(const uint8_t *src, size_t size, float *recon, size_t count, float error_bound) {
+    if (error_bound <= 0.0f)
+        return decode_words(src, size, recon, count, sizeof(float), 1, recon);
+
+    float step = codec_step(error_bound);
+    uint64_t sym[CODEC_BLOCK];
+    BitReader reader = { src, src + size, 0, 0, 0 };
+
+    for (size_t base = 0; base < count; base += CODEC_BLOCK) {
+        int n = count - base < CODEC_BLOCK ? (int)(count - base) : CODEC_BLOCK;
+        if (!decode_block(&reader, sym, n, 32)) return 0;
+        float *r = recon + base;
+        if (sym[0] == CODEC_EXACT_BLOCK) {
+            if (!decode_block(&reader, sym, n, 32)) return 0;
+            for (int i = 0; i < n; i++) {
+                uint64_t b = word_load((const uint8_t *)(r + i), 4, 1);
+                word_store((uint8_t *)(r + i), b + (uint64_t)unzigzag(sym[i]), 4, 1);
+            }
+            continue;
+        }
+        for (int i = 0; i < n; i++) r[i] += (float)unzigzag(sym[i]) * step;
+    }
+    return reader.pad * 8 <= reader.bits;
+}
+
+// only one write in flight, the solver keeps running while it goes to disk
+typedef struct {
+    SDL_Thread *thread;
+    SDL_atomic_t busy;
+    char path[256];
+    void *snapshot;
+    size_t size;
+    int compress;
+} CheckpointWriter;
+
+static size_t checkpoint_align(size_t n) {
+    return (n + CHECKPOINT_ALIGN - 1) & ~(size_t)(CHECKPOINT_ALIGN - 1);
+}
+
+// emitter arrays are packed back to back after the grids
+static size_t emitter_bytes(int count) {
+    return count * (sizeof(int64_t) + sizeof(uint8_t) + 6 * sizeof(float));
+}
+
+void checkpoint_layout(CheckpointHeader *header, const FluidGrid *fluid) {
+    size_t grid_bytes = checkpoint_align(GRID_CELLS * sizeof(cell_t));
+    size_t offset = CHECKPOINT_ALIGN;
+
+    memset(header, 0, sizeof(*header));
+    header->magic = CHECKPOINT_MAGIC;
+    header->version = CHECKPOINT_VERSION;
+    header->width = GRID_WIDTH;
+    header->height = GRID_HEIGHT;
+    header->storage = FLUID_STORAGE;
+    header->cell_bytes = sizeof(cell_t);
+    header->damping = fluid->damping;
+    header->damping_model = fluid->damping_model;
+    header->emitter_count = fluid->emitters.count;
+    header->step = fluid->step;
+    header->emitter_ticks = fluid->emitters.ticks;
+
+    header->current_offset = offset;
+    offset += grid_bytes;
+    header->previous_offset = offset;
+    offset += grid_bytes;
+#if FLUID_STORAGE == FLUID_KAHAN
+    size_t lo_bytes = checkpoint_align(GRID_CELLS * sizeof(float));
+    header->current_lo_offset = offset;
+    offset += lo_bytes;
+    header->previous_lo_offset = offset;
+    offset += lo_bytes;
+#endif
+    header->emitter_offset = offset;
+    header->file_size = offset + emitter_bytes(fluid->emitters.count);
+}
+
+// copies the whole state into one buffer laid out exactly like the file
+void *checkpoint_snapshot(const FluidGrid *fluid, size_t *size) {
+    CheckpointHeader header;
+    checkpoint_layout(&header, fluid);
+
+    uint8_t *buf = calloc(1, header.file_size);
+    if (!buf) {
+        printf("Failed to allocate checkpoint snapshot\n");
+        return NULL;
+    }
+
+    memcpy(buf, &header, sizeof(header));
+    memcpy(buf + header.current_offset, fluid->current, GRID_CELLS * sizeof(cell_t));
+    memcpy(buf + header.previous_offset, fluid->previous, GRID_CELLS * sizeof(cell_t));
+#if FLUID_STORAGE == FLUID_KAHAN
+    memcpy(buf + header.current_lo_offset, fluid->current_lo, GRID_CELLS * sizeof(float));
+    memcpy(buf + header.previous_lo_offset, fluid->previous_lo, GRID_CELLS * sizeof(float));
+#endif
+
+    const EmitterSet *set = &fluid->emitters;
+    int n = set->count;
+    uint8_t *p = buf + header.emitter_offset;
+    memcpy(p, set->cell, n * sizeof(int64_t)); p += n * sizeof(int64_t);
+    const float *arrays[] = { set->gain, set->amplitude, set->re, set->im, set->cos_w, set->sin_w };
+    for (int i = 0; i < 6; i++) {
+        memcpy(p, arrays[i], n * sizeof(float));
+        p += n * sizeof(float);
+    }
+    memcpy(p, set->kind, n * sizeof(uint8_t));
+
+    *size = header.file_size;
+    return buf;
+}
+
+// delta codes a snapshot: previous on its own, current against previous (they are one
+// step apart), kahan residues on their own, emitters copied as they are
+void *checkpoint_compress(const uint8_t *snapshot, size_t *size) {
+    const CheckpointHeader *raw = (const CheckpointHeader *)snapshot;
+    CheckpointHeader header = *raw;
+    size_t emitters = emitter_bytes(raw->emitter_count);
+    size_t cap = sizeof(header) + 2 * CODEC_BOUND(GRID_CELLS, sizeof(cell_t)) + emitters;
+#if FLUID_STORAGE == FLUID_KAHAN
+    cap += 2 * CODEC_BOUND(GRID_CELLS, sizeof(float));
+#endif
+    uint8_t *buf = malloc(cap);
+    if (!buf) {
+        printf("Failed to allocate compressed checkpoint\n");
+        return NULL;
+    }
+
+    const uint8_t *previous = snapshot + raw->previous_offset;
+    size_t offset = sizeof(header);
+    header.codec = CHECKPOINT_DELTA;
+    header.previous_offset = offset;
+    header.previous_bytes = encode_words(previous, NULL, GRID_CELLS, sizeof(cell_t), CELL_IS_FLOAT, buf + offset);
+    offset += header.previous_bytes;
+    header.current_offset = offset;
+    header.current_bytes = encode_words(snapshot + raw->current_offset, previous, GRID_CELLS,
+                                        sizeof(cell_t), CELL_IS_FLOAT, buf + offset);
+    offset += header.current_bytes;
+#if FLUID_STORAGE == FLUID_KAHAN
+    header.previous_lo_offset = offset;
+    header.previous_lo_bytes = encode_words(snapshot + raw->previous_lo_offset, NULL, GRID_CELLS,
+                                            sizeof(float), 1, buf + offset);
+    offset += header.previous_lo_bytes;
+    header.current_lo_offset = offset;
+    header.current_lo_bytes = encode_words(snapshot + raw->current_lo_offset, NULL, GRID_CELLS,
+                                           sizeof(float), 1, buf + offset);
+    offset += header.current_lo_bytes;
+#endif
+    header.emitter_offset = offset;
+    memcpy(buf + offset, snapshot + raw->emitter_offset, emitters);
+    offset += emitters;
+    header.file_size = offset;
+    memcpy(buf, &header, sizeof(header));
+
+    *size = offset;
+    return buf;
+}
+
+// writes to a temp file, syncs it and renames, so a crash never leaves a torn checkpoint
+int write_file_atomic(const char *path, const void *data, size_t size) {
+    char tmp[300];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    FILE *f = fopen(tmp, "wb");
+    if (!f) {
+        printf("Failed to open %s\n", tmp);
+        return 0;
+    }
+    // the data has to be on disk before the rename is, or a power loss can keep the new name
+    // with an empty file
+    int ok = fwrite(data, 1, size, f) == size && fflush(f) == 0 && fsync(fileno(f)) == 0;
+    if (fclose(f) != 0) ok = 0;
+    if (!ok || rename(tmp, path) != 0) {
+        printf("Failed to write %s\n", path);
+        remove(tmp);
+        return 0;
+    }
+    return 1;
+}
+
+static int checkpoint_thread(void *data) {
+    CheckpointWriter *writer = data;
+    if (writer->compress) {
+        size_t size;
+        void *packed = checkpoint_compress(writer->snapshot, &size);
+        if (packed) {
+            free(writer->snapshot);
+            writer->snapshot = packed;
+            writer->size = size;
+        }
+    }
+    write_file_atomic(writer->path, writer->snapshot, writer->size);
+    free(writer->snapshot);
+    writer->snapshot = NULL;
+    SDL_AtomicSet(&writer->busy, 0);
+    return 0;
+}
+
+void checkpoint_wait(CheckpointWriter *writer) {
+    if (writer->thread) {
+        SDL_WaitThread(writer->thread, NULL);
+        writer->thread = NULL;
+    }
+}
+
+// the solver only pauses for the snapshot copy, disk i/o happens on a thread
+int save_checkpoint_async(CheckpointWriter *writer, const FluidGrid *fluid, const char *path) {
+    if (SDL_AtomicGet(&writer->busy)) {
+        printf("checkpoint still writing, skipped\n");
+        return 0;
+    }
+    checkpoint_wait(writer);
+
+    writer->snapshot = checkpoint_snapshot(fluid, &writer->size);
+    if (!writer->snapshot) return 0;
+    snprintf(writer->path, sizeof(writer->path), "%s", path);
+
+    SDL_AtomicSet(&writer->busy, 1);
+    writer->thread = SDL_CreateThread(checkpoint_thread, "checkpoint", writer);
+    if (!writer->thread) {
+        // no thread, write inline
+        checkpoint_thread(writer);
+    }
+    return 1;
+}
+
+static void read_emitters(EmitterSet *set, const uint8_t *base, const CheckpointHeader *header) {
+    int n = header->emitter_count;
+    memset(set, 0, sizeof(*set));
+    if (n > 0 && reserve_emitters(set, n)) {
+        const uint8_t *p = base + header->emitter_offset;
+        memcpy(set->cell, p, n * sizeof(int64_t)); p += n * sizeof(int64_t);
+        float *arrays[] = { set->gain, set->amplitude, set->re, set->im, set->cos_w, set->sin_w };
+        for (int i = 0; i < 6; i++) {
+            memcpy(arrays[i], p, n * sizeof(float));
+            p += n * sizeof(float);
+        }
+        memcpy(set->kind, p, n * sizeof(uint8_t));
+        set->count = n;
+        set->ticks = header->emitter_ticks;
+    }
+}
+
+// points the grid at arrays inside a mapped checkpoint file
+static void attach_mapping(FluidGrid *fluid, uint8_t *base, const CheckpointHeader *header) {
+    fluid->current = (cell_t *)(base + header->current_offset);
+    fluid->previous = (cell_t *)(base + header->previous_offset);
+#if FLUID_STORAGE == FLUID_KAHAN
+    fluid->current_lo = (float *)(base + header->current_lo_offset);
+    fluid->previous_lo = (float *)(base + header->previous_lo_offset);
+#endif
+    fluid->mapping = base;
+    fluid->mapping_size = header->file_size;
+    fluid->backing = NULL;
+    fluid->damping = header->damping;
+    fluid->damping_model = header->damping_model < DAMPING_MODELS ? header->damping_model : DAMPING_HEIGHT;
+    fluid->step = header->step;
+    fluid->quiet_steps = 0;
+    fluid->idle = 0;
+    touch_all(fluid);
+
+    // emitters are small, copy them out of the mapping
+    read_emitters(&fluid->emitters, base, header);
+    alloc_windows(fluid);
+}
+static int checkpoint_matches(const CheckpointHeader *header) {
+    return header->width == GRID_WIDTH && header->height == GRID_HEIGHT &&
+           header->storage == FLUID_STORAGE && header->cell_bytes == sizeof(cell_t);
+}
+
+static int checkpoint_region(const CheckpointHeader *header, uint64_t offset, uint64_t bytes) {
+    return offset >= sizeof(*header) && offset <= header->file_size && bytes <= header->file_size - offset;
+}
+
+// a raw checkpoint is used in place, so every array its header points at has to
+// lie inside the file and be aligned for its type before anything is cast or read
+static int checkpoint_raw_regions(const CheckpointHeader *header) {
+    uint64_t grid = GRID_CELLS * sizeof(cell_t);
+    int ok = header->emitter_count <= GRID_CELLS &&
+             checkpoint_region(header, header->current_offset, grid) &&
+             checkpoint_region(header, header->previous_offset, grid) &&
+             checkpoint_region(header, header->emitter_offset, emitter_bytes(header->emitter_count)) &&
+             header->current_offset % sizeof(cell_t) == 0 && header->previous_offset % sizeof(cell_t) == 0;
+#if FLUID_STORAGE == FLUID_KAHAN
+    uint64_t lo = GRID_CELLS * sizeof(float);
+    ok = ok && checkpoint_region(header, header->current_lo_offset, lo) &&
+         checkpoint_region(header, header->previous_lo_offset, lo) &&
+         header->current_lo_offset % sizeof(float) == 0 && header->previous_lo_offset % sizeof(float) == 0;
+#endif
+    return ok;
+}
+
+// compressed checkpoints decode into freshly allocated buffers
+static int decode_checkpoint(FluidGrid *fluid, const uint8_t *base, const CheckpointHeader *header) {
+    if (header->emitter_count > GRID_CELLS ||
+        !checkpoint_region(header, header->previous_offset, header->previous_bytes) ||
+        !checkpoint_region(header, header->current_offset, header->current_bytes) ||
+        !checkpoint_region(header, header->emitter_offset, emitter_bytes(header->emitter_count)))
+        return 0;
+
+    FluidGrid decoded;
+    init_fluid(&decoded);
+    int ok = decoded.current && decoded.previous &&
+             decode_words(base + header->previous_offset, header->previous_bytes, NULL, GRID_CELLS,
+                          sizeof(cell_t), CELL_IS_FLOAT, decoded.previous) &&
+             decode_words(base + header->current_offset, header->current_bytes, decoded.previous,
+                          GRID_CELLS, sizeof(cell_t), CELL_IS_FLOAT, decoded.current);
+#if FLUID_STORAGE == FLUID_KAHAN
+    ok = ok && checkpoint_region(header, header->previous_lo_offset, header->previous_lo_bytes) &&
+         checkpoint_region(header, header->current_lo_offset, header->current_lo_bytes) &&
+         decode_words(base + header->previous_lo_offset, header->previous_lo_bytes, NULL, GRID_CELLS,
+                      sizeof(float), 1, decoded.previous_lo) &&
+         decode_words(base + header->current_lo_offset, header->current_lo_bytes, NULL, GRID_CELLS,
+                      sizeof(float), 1, decoded.current_lo);
+#endif
+    if (!ok) {
+        free_fluid(&decoded);
+        return 0;
+    }
+
+    decoded.damping = header->damping;
+    decoded.damping_model = header->damping_model < DAMPING_MODELS ? header->damping_model : DAMPING_HEIGHT;
+    decoded.step = header->step;
+    read_emitters(&decoded.emitters, base, header);
+    decoded.probes = fluid->probes;
+    decoded.obstacles = fluid->obstacles;
+    decoded.speed = fluid->speed;
+    decoded.damping_map = fluid->damping_map;
+    decoded.stats = fluid->stats;
+    decoded.boundary = fluid->boundary;
+    free_fluid(fluid);
+    *fluid = decoded;
+    return 1;
+}
+
+// copies a checkpoint read into a scratch grid over a backed grid's buffers
+static void adopt_checkpoint(FluidGrid *fluid, FluidGrid *loaded) {
+    memcpy(fluid->current, loaded->current, GRID_CELLS * sizeof(cell_t));
+    memcpy(fluid->previous, loaded->previous, GRID_CELLS * sizeof(cell_t));
+#if FLUID_STORAGE == FLUID_KAHAN
+    memcpy(fluid->current_lo, loaded->current_lo, GRID_CELLS * sizeof(float));
+    memcpy(fluid->previous_lo, loaded->previous_lo, GRID_CELLS * sizeof(float));
+#endif
+    free_emitters(&fluid->emitters);
+    fluid->emitters = loaded->emitters;
+    memset(&loaded->emitters, 0, sizeof(loaded->emitters));
+    fluid->damping = loaded->damping;
+    fluid->damping_model = loaded->damping_model;
+    fluid->step = loaded->step;
+    fluid->quiet_steps = 0;
+    fluid->idle = 0;
+    touch_all(fluid);
+    free_fluid(loaded);
+}
+
+// maps the file copy-on-write, pages fault in as the solver touches them.
+// a grid with a backing file gets the checkpoint copied into that file instead
+static int read_checkpoint(FluidGrid *fluid, const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        printf("Failed to open %s\n", path);
+        return 0;
+    }
+
+    CheckpointHeader header;
+    struct stat st;
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || fstat(fd, &st) != 0 ||
+        header.magic != CHECKPOINT_MAGIC || header.version != CHECKPOINT_VERSION ||
+        (uint64_t)st.st_size < header.file_size) {
+        printf("%s is not a checkpoint\n", path);
+        close(fd);
+        return 0;
+    }
+    if (!checkpoint_matches(&header)) {
+        printf("%s is %ux%u storage %u, this build is %dx%d %s\n", path,
+               header.width, header.height, header.storage, GRID_WIDTH, GRID_HEIGHT, CELL_NAME);
+        close(fd);
+        return 0;
+    }
+    int sound = header.codec == CHECKPOINT_DELTA || (header.codec == 0 && checkpoint_raw_regions(&header));
+    if (!sound) {
+        printf("%s: corrupt checkpoint header\n", path);
+        close(fd);
+        return 0;
+    }
+
+    uint8_t *base = mmap(NULL, header.file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        printf("Failed to map %s\n", path);
+        return 0;
+    }
+
+    // a grid in a backing file stays there, the checkpoint goes to a scratch grid first
+    FluidGrid loaded;
+    FluidGrid *into = fluid;
+    if (fluid->backing) {
+        memset(&loaded, 0, sizeof(loaded));
+        into = &loaded;
+    }
+
+    if (header.codec == CHECKPOINT_DELTA) {
+        int ok = decode_checkpoint(into, base, &header);
+        munmap(base, header.file_size);
+        if (!ok) printf("%s: corrupt compressed checkpoint\n", path);
+        if (ok && into == &loaded) adopt_checkpoint(fluid, &loaded);
+        return ok;
+    }
+
+    free_fluid(into);
+    attach_mapping(into, base, &header);
+    if (into == &loaded) adopt_checkpoint(fluid, &loaded);
+    return 1;
+}
+
+int load_checkpoint(FluidGrid *fluid, const char *path) {
+    if (!read_checkpoint(fluid, path)) return 0;
+    // the checkpoint may come from a run without this mask, or with another
+    // one. solid cells are held at zero, the same as after --obstacles
+    if (fluid->obstacles) attach_obstacles(fluid, fluid->obstacles);
+    return 1;
+}
+
+// out-of-core grid: the buffers are a shared mapping of path in checkpoint layout,
+// so the os streams bands to and from disk and the file is a checkpoint at any time.
+// an existing file with the same size and storage is resumed, a new or empty one
+// gets a fresh grid and anything else is refused rather than overwritten
+int init_fluid_mapped(FluidGrid *fluid, const char *path) {
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        printf("Failed to open %s\n", path);
+        return 0;
+    }
+
+    CheckpointHeader header;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        printf("Failed to stat %s\n", path);
+        close(fd);
+        return 0;
+    }
+
+    // only an empty file gets a fresh grid, anything else is resumed or left alone
+    int resume = st.st_size > 0;
+    const char *why = NULL;
+    if (resume) {
+        if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || header.magic != CHECKPOINT_MAGIC ||
+            header.version != CHECKPOINT_VERSION)
+            why = "not a checkpoint";
+        else if (header.codec != 0)
+            why = "a compressed checkpoint";
+        else if (!checkpoint_matches(&header))
+            why = "a checkpoint from a build with another grid size or storage";
+        else if ((uint64_t)st.st_size < header.file_size)
+            why = "a truncated checkpoint";
+        else if (!checkpoint_raw_regions(&header))
+            why = "a checkpoint with a corrupt header";
+    }
+    if (why) {
+        printf("%s is %s, not resuming it as a backing file\n", path, why);
+        close(fd);
+        return 0;
+    }
+
+    if (!resume) {
+        FluidGrid empty = {0};
+        empty.damping = 0.99f;
+        checkpoint_layout(&header, &empty);
+        if (ftruncate(fd, header.file_size) != 0) {
+            printf("Failed to size %s\n", path);
+            close(fd);
+            return 0;
+        }
+    }
+
+    uint8_t *base = mmap(NULL, header.file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        printf("Failed to map %s\n", path);
+        return 0;
+    }
+    if (!resume) memcpy(base, &header, sizeof(header));
+    madvise(base, header.file_size, MADV_SEQUENTIAL);
+
+    memset(fluid, 0, sizeof(*fluid));
+    attach_mapping(fluid, base, &header);
+    fluid->backing = (CheckpointHeader *)base;
+
+    // emitters live in memory only
+    fluid->backing->emitter_count = 0;
+    return 1;
+}
+
+// current heights as float32, whatever the storage
+static void load_field(const FluidGrid *fluid, float *dst) {
+#if FLUID_STORAGE == FLUID_FLOAT32 || FLUID_STORAGE == FLUID_KAHAN
+    memcpy(dst, fluid->current, GRID_CELLS * sizeof(float));
+#else
+    for (size_t i = 0; i < GRID_CELLS; i++) dst[i] = CELL_LOAD(fluid->current[i]);
+#endif
+}
+
+// bounded queue of fixed size frame slots between the solver and a worker thread.
+// the producer fills a slot in place, the consumer holds the head slot until released
+typedef struct {
+    SDL_mutex *lock;
+    SDL_cond *not_empty;
+    SDL_cond *not_full;
+    uint8_t *slots;
+    size_t slot_bytes;
+    size_t *sizes;
+    uint64_t *tags;
+    int capacity;
+    int head;
+    int count;
+    int closed;
+    unsigned long dropped;
+} FrameQueue;
+
+int init_frame_queue(FrameQueue *q, int capacity, size_t slot_bytes) {
+    memset(q, 0, sizeof(*q));
+    q->slots = malloc(capacity * slot_bytes);
+    q->sizes = calloc(capacity, sizeof(size_t));
+    q->tags = calloc(capacity, sizeof(uint64_t));
+    q->lock = SDL_CreateMutex();
+    q->not_empty = SDL_CreateCond();
+    q->not_full = SDL_CreateCond();
+    if (!q->slots || !q->sizes || !q->tags || !q->lock || !q->not_empty || !q->not_full) {
+        printf("Failed to allocate frame queue\n");
+        return 0;
+    }
+    q->slot_bytes = slot_bytes;
+    q->capacity = capacity;
+    return 1;
+}
+
+void free_frame_queue(FrameQueue *q) {
+    free(q->slots);
+    free(q->sizes);
+    free(q->tags);
+    if (q->lock) SDL_DestroyMutex(q->lock);
+    if (q->not_empty) SDL_DestroyCond(q->not_empty);
+    if (q->not_full) SDL_DestroyCond(q->not_full);
+    memset(q, 0, sizeof(*q));
+}
+
+// slot to fill, or NULL when full and not blocking (the frame is counted as dropped)
+uint8_t *frame_queue_begin_push(FrameQueue *q, int block) {
+    SDL_LockMutex(q->lock);
+    while (block && q->count == q->capacity && !q->closed) {
+        SDL_CondWait(q->not_full, q->lock);
+    }
+    if (q->count == q->capacity || q->closed) {
+        q->dropped++;
+        SDL_UnlockMutex(q->lock);
+        return NULL;
+    }
+    int slot = (q->head + q->count) % q->capacity;
+    SDL_UnlockMutex(q->lock);
+    return q->slots + slot * q->slot_bytes;
+}
+
+void frame_queue_end_push(FrameQueue *q, size_t size, uint64_t tag) {
+    SDL_LockMutex(q->lock);
+    int slot = (q->head + q->count) % q->capacity;
+    q->sizes[slot] = size;
+    q->tags[slot] = tag;
+    q->count++;
+    SDL_CondSignal(q->not_empty);
+    SDL_UnlockMutex(q->lock);
+}
+
+// waits for the head frame, returns 0 once the queue is closed and drained
+int frame_queue_pop(FrameQueue *q, uint8_t **data, size_t *size, uint64_t *tag) {
+    SDL_LockMutex(q->lock);
+    while (q->count == 0 && !q->closed) {
+        SDL_CondWait(q->not_empty, q->lock);
+    }
+    if (q->count == 0) {
+        SDL_UnlockMutex(q->lock);
+        return 0;
+    }
+    *data = q->slots + q->head * q->slot_bytes;
+    *size = q->sizes[q->head];
+    *tag = q->tags[q->head];
+    SDL_UnlockMutex(q->lock);
+    return 1;
+}
+
+void frame_queue_release(FrameQueue *q) {
+    SDL_LockMutex(q->lock);
+    q->head = (q->head + 1) % q->capacity;
+    q->count--;
+    SDL_CondSignal(q->not_full);
+    SDL_UnlockMutex(q->lock);
+}
+
+void frame_queue_close(FrameQueue *q) {
+    SDL_LockMutex(q->lock);
+    q->closed = 1;
+    SDL_CondBroadcast(q->not_empty);
+    SDL_CondBroadcast(q->not_full);
+    SDL_UnlockMutex(q->lock);
+}
+
+static uint8_t *put_varint(uint8_t *p, uint64_t v) {
+    while (v >= 0x80) {
+        *p++ = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (uint8_t)v;
+    return p;
+}
+
+static const uint8_t *get_varint(const uint8_t *p, const uint8_t *end, uint64_t *v) {
+    uint64_t r = 0;
+    int shift = 0;
+    while (p < end && shift < 64) {
+        uint8_t b = *p++;
+        r |= (uint64_t)(b & 0x7F) << shift;
+        if (!(b & 0x80)) {
+            *v = r;
+            return p;
+        }
+        shift += 7;
+    }
+    return NULL;
+}
+
+// worst case size of zrle_encode output
+#define ZRLE_BOUND(n) ((n) + (n) / 2 + 16)
+
+// zero run-length: [literal length][literal bytes][zero run length] repeated.
+// calm water quantizes to long runs of zero bytes
+size_t zrle_encode(const uint8_t *src, size_t n, uint8_t *dst) {
+    uint8_t *out = dst;
+    size_t i = 0;
+
+    while (i < n) {
+        // literal up to the next run of at least 8 zeros
+        size_t lit = i;
+        while (lit < n) {
+            if (src[lit] == 0) {
+                size_t z = lit;
+                while (z < n && src[z] == 0 && z - lit < 8) z++;
+                if (z - lit >= 8 || z == n) break;
+                lit = z;
+            } else {
+                lit++;
+            }
+        }
+        size_t zeros = lit;
+        while (zeros < n && src[zeros] == 0) zeros++;
+
+        out = put_varint(out, lit - i);
+        memcpy(out, src + i, lit - i);
+        out += lit - i;
+        out = put_varint(out, zeros - lit);
+        i = zeros;
+    }
+    return out - dst;
+}
+
+// returns bytes written to dst, or 0 if the stream is corrupt
+size_t zrle_decode(const uint8_t *src, size_t n, uint8_t *dst, size_t cap) {
+    const uint8_t *end = src + n;
+    size_t o = 0;
+
+    while (src < end) {
+        uint64_t lit, zeros;
+        src = get_varint(src, end, &lit);
+        if (!src || lit > (uint64_t)(end - src) || o + lit > cap) return 0;
+        memcpy(dst + o, src, lit);
+        src += lit;
+        o += lit;
+        src = get_varint(src, end, &zeros);
+        if (!src || o + zeros > cap) return 0;
+        memset(dst + o, 0, zeros);
+        o += zeros;
+    }
+    return o;
+}
+
+// time-series file: header, chunks of frames, chunk index at the end.
+// the header is rewritten on close with the index offset and frame count
+#define SERIES_MAGIC 0x53544C46  // "FLTS"
+#define SERIES_CHUNK_MAGIC 0x4B4E4843  // "CHNK"
+#define SERIES_VERSION 1
+#define SERIES_QUEUE_FRAMES 8
+
+enum {
+    SERIES_RAW = 0,
+    SERIES_ZRLE = 1,
+    SERIES_DELTA = 2    // each frame delta coded against the previous one in its chunk
+};
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t quant_bits;        // 0 float32, 8 or 16 signed with a per-frame scale
+    uint32_t compression;
+    uint32_t every;
+    uint32_t frames_per_chunk;
+    uint64_t frame_count;
+    uint64_t chunk_count;
+    uint64_t index_offset;
+} SeriesHeader;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t frames;
+    uint64_t raw_bytes;
+    uint64_t stored_bytes;
+} SeriesChunkHeader;
+
+typedef struct {
+    uint64_t step;
+    float scale;                // value = q * scale, the error bound for delta frames
+    uint32_t bytes;
+} SeriesFrameHeader;
+
+typedef struct {
+    uint64_t first_step;
+    uint64_t offset;
+    uint32_t frames;
+    uint32_t reserved;
+} SeriesIndexEntry;
+
+typedef struct {
+    FILE *file;
+    SeriesHeader header;
+    FrameQueue queue;
+    SDL_Thread *thread;
+    uint8_t *chunk;             // frames of the chunk being built
+    size_t chunk_used;
+    uint32_t chunk_frames;
+    uint64_t chunk_first_step;
+    uint8_t *packed;
+    SeriesIndexEntry *index;
+    size_t index_capacity;
+    float *recon;               // what the reader will have decoded, for delta frames
+    float error_bound;
+    int failed;
+} SeriesWriter;
+
+static size_t series_frame_bytes(const SeriesHeader *header) {
+    if (header->compression == SERIES_DELTA)
+        return sizeof(SeriesFrameHeader) + CODEC_BOUND((size_t)header->width * header->height, sizeof(float));
+    size_t cell = header->quant_bits ? header->quant_bits / 8 : sizeof(float);
+    return sizeof(SeriesFrameHeader) + (size_t)header->width * header->height * cell;
+}
+
+// quantizes one float frame into dst, returns bytes used
+static size_t series_pack_frame(const SeriesHeader *header, const float *field, uint64_t step, uint8_t *dst) {
+    size_t cells = (size_t)header->width * header->height;
+    SeriesFrameHeader fh = { step, 1.0f, 0 };
+
+    float peak = 0.0f;
+    if (header->quant_bits) {
+        for (size_t i = 0; i < cells; i++) peak = fmaxf(peak, fabsf(field[i]));
+    }
+
+    uint8_t *data = dst + sizeof(fh);
+    if (header->quant_bits == 8) {
+        fh.scale = peak > 0.0f ? peak / 127.0f : 1.0f;
+        float inv = 1.0f / fh.scale;
+        int8_t *q = (int8_t *)data;
+        for (size_t i = 0; i < cells; i++) q[i] = (int8_t)lrintf(field[i] * inv);
+        fh.bytes = cells;
+    } else if (header->quant_bits == 16) {
+        fh.scale = peak > 0.0f ? peak / 32767.0f : 1.0f;
+        float inv = 1.0f / fh.scale;
+        int16_t *q = (int16_t *)data;
+        for (size_t i = 0; i < cells; i++) q[i] = (int16_t)lrintf(field[i] * inv);
+        fh.bytes = cells * 2;
+    } else {
+        memcpy(data, field, cells * sizeof(float));
+        fh.bytes = cells * sizeof(float);
+    }
+
+    memcpy(dst, &fh, sizeof(fh));
+    return sizeof(fh) + fh.bytes;
+}
+
+// the first frame of a chunk is coded against zeros so chunks decode on their own
+static size_t series_delta_frame(SeriesWriter *w, const float *field, uint64_t step, uint8_t *dst) {
+    size_t cells = (size_t)w->header.width * w->header.height;
+    if (w->chunk_frames == 0) memset(w->recon, 0, cells * sizeof(float));
+
+    SeriesFrameHeader fh = { step, w->error_bound, 0 };
+    fh.bytes = encode_field(field, w->recon, cells, w->error_bound, dst + sizeof(fh));
+    memcpy(dst, &fh, sizeof(fh));
+    return sizeof(fh) + fh.bytes;
+}
+
+static void series_flush_chunk(SeriesWriter *w) {
+    if (w->chunk_frames == 0 || w->failed) return;
+
+    SeriesChunkHeader ch = { SERIES_CHUNK_MAGIC, w->chunk_frames, w->chunk_used, w->chunk_used };
+    const uint8_t *payload = w->chunk;
+    if (w->header.compression == SERIES_DELTA) {
+        ch.raw_bytes = (uint64_t)w->chunk_frames * w->header.width * w->header.height * sizeof(float);
+    } else if (w->header.compression == SERIES_ZRLE) {
+        ch.stored_bytes = zrle_encode(w->chunk, w->chunk_used, w->packed);
+        payload = w->packed;
+    }
+
+    if (w->header.chunk_count == w->index_capacity) {
+        size_t n = w->index_capacity ? w->index_capacity * 2 : 64;
+        SeriesIndexEntry *index = realloc(w->index, n * sizeof(*index));
+        if (!index) {
+            w->failed = 1;
+            return;
+        }
+        w->index = index;
+        w->index_capacity = n;
+    }
+    SeriesIndexEntry *entry = &w->index[w->header.chunk_count++];
+    entry->first_step = w->chunk_first_step;
+    entry->offset = ftell(w->file);
+    entry->frames = w->chunk_frames;
+    entry->reserved = 0;
+
+    if (fwrite(&ch, sizeof(ch), 1, w->file) != 1 ||
+        fwrite(payload, 1, ch.stored_bytes, w->file) != ch.stored_bytes) {
+        printf("Failed to write time series chunk, series stopped\n");
+        w->header.chunk_count--;
+        w->failed = 1;
+        return;
+    }
+    w->header.frame_count += w->chunk_frames;
+    w->chunk_used = 0;
+    w->chunk_frames = 0;
+}
+
+static int series_thread(void *data) {
+    SeriesWriter *w = data;
+    uint8_t *frame;
+    size_t size;
+    uint64_t step;
+
+    while (frame_queue_pop(&w->queue, &frame, &size, &step)) {
+        // after a failed write the queue is only drained, the chunk buffer is not refilled
+        if (w->failed) {
+            frame_queue_release(&w->queue);
+            continue;
+        }
+        if (w->chunk_frames == 0) w->chunk_first_step = step;
+        if (w->header.compression == SERIES_DELTA)
+            w->chunk_used += series_delta_frame(w, (const float *)frame, step, w->chunk + w->chunk_used);
+        else
+            w->chunk_used += series_pack_frame(&w->header, (const float *)frame, step, w->chunk + w->chunk_used);
+        w->chunk_frames++;
+        frame_queue_release(&w->queue);
+
+        if (w->chunk_frames == w->header.frames_per_chunk) series_flush_chunk(w);
+    }
+    series_flush_chunk(w);
+    return 0;
+}
+
+// compression is SERIES_RAW, SERIES_ZRLE or SERIES_DELTA (which quantizes on its
+// own to error_bound, 0 for lossless, and ignores quant_bits)
+int open_series(SeriesWriter *w, const char *path, int every, int quant_bits, int compression,
+                float error_bound, int frames_per_chunk) {
+    memset(w, 0, sizeof(*w));
+    w->header.magic = SERIES_MAGIC;
+    w->header.version = SERIES_VERSION;
+    w->header.width = GRID_WIDTH;
+    w->header.height = GRID_HEIGHT;
+    w->header.quant_bits = quant_bits == 8 || quant_bits == 16 ? quant_bits : 0;
+    w->header.compression = compression == SERIES_ZRLE || compression == SERIES_DELTA ? compression : SERIES_RAW;
+    w->header.every = every > 0 ? every : 1;
+    w->header.frames_per_chunk = frames_per_chunk > 0 ? frames_per_chunk : 16;
+    w->error_bound = error_bound > 0.0f ? error_bound : 0.0f;
+    if (w->header.compression == SERIES_DELTA) w->header.quant_bits = 0;
+
+    // SeriesFrameHeader.bytes is 32 bit, a frame that does not fit would wrap to garbage
+    if (series_frame_bytes(&w->header) - sizeof(SeriesFrameHeader) > UINT32_MAX) {
+        printf("Grid too large for a time series, one frame exceeds 4 GiB\n");
+        return 0;
+    }
+
+    size_t chunk_bytes = series_frame_bytes(&w->header) * w->header.frames_per_chunk;
+    int zrle = w->header.compression == SERIES_ZRLE;
+    int delta = w->header.compression == SERIES_DELTA;
+    w->chunk = malloc(chunk_bytes);
+    w->packed = zrle ? malloc(ZRLE_BOUND(chunk_bytes)) : NULL;
+    w->recon = delta ? malloc(GRID_CELLS * sizeof(float)) : NULL;
+    w->file = fopen(path, "wb");
+    if (!w->chunk || (zrle && !w->packed) || (delta && !w->recon) || !w->file ||
+        !init_frame_queue(&w->queue, SERIES_QUEUE_FRAMES, GRID_CELLS * sizeof(float))) {
+        printf("Failed to open time series %s\n", path);
+        return 0;
+    }
+    fwrite(&w->header, sizeof(w->header), 1, w->file);
+
+    w->thread = SDL_CreateThread(series_thread, "series", w);
+    if (!w->thread) {
+        printf("Failed to start time series writer\n");
+        return 0;
+    }
+    return 1;
+}
+
+// called after update_fluid, only copies the field, never waits on the disk
+void series_push(SeriesWriter *w, const FluidGrid *fluid) {
+    if (!w->file || fluid->step % w->header.every != 0) return;
+
+    float *slot = (float *)frame_queue_begin_push(&w->queue, 0);
+    if (!slot) return;
+    load_field(fluid, slot);
+    frame_queue_end_push(&w->queue, GRID_CELLS * sizeof(float), fluid->step);
+}
+
+void close_series(SeriesWriter *w) {
+    if (!w->file) return;
+
+    frame_queue_close(&w->queue);
+    if (w->thread) SDL_WaitThread(w->thread, NULL);
+
+    // a failed series keeps the empty header from open_series, it never claims lost frames
+    if (!w->failed) {
+        long end = ftell(w->file);
+        w->header.index_offset = end;
+        if (end < 0 ||
+            fwrite(w->index, sizeof(SeriesIndexEntry), w->header.chunk_count, w->file) != w->header.chunk_count ||
+            fseek(w->file, 0, SEEK_SET) != 0 || fwrite(&w->header, sizeof(w->header), 1, w->file) != 1)
+            w->failed = 1;
+    }
+    if (fclose(w->file) != 0) w->failed = 1;
+    if (w->failed) printf("time series: write failed, the file is incomplete\n");
+
+    if (w->queue.dropped)
+        printf("time series: %lu frames dropped, writer could not keep up\n", w->queue.dropped);
+
+    free_frame_queue(&w->queue);
+    free(w->chunk);
+    free(w->packed);
+    free(w->recon);
+    free(w->index);
+    memset(w, 0, sizeof(*w));
+}
+
+// walks the index and decodes every frame, prints one line per frame
+int dump_series(const char *path) {
+    FILE *f = fopen(path, "rb");
+    SeriesHeader header;
+    if (!f || fread(&header, sizeof(header), 1, f) != 1 || header.magic != SERIES_MAGIC) {
+        printf("%s is not a time series\n", path);
+        if (f) fclose(f);
+        return 1;
+    }
+
+    const char *names[] = { "raw", "zrle", "delta" };
+    printf("%ux%u, %llu frames in %llu chunks, every %u steps, %u bit, %s\n",
+           header.width, header.height, (unsigned long long)header.frame_count,
+           (unsigned long long)header.chunk_count, header.every,
+           header.quant_bits ? header.quant_bits : 32,
+           header.compression <= SERIES_DELTA ? names[header.compression] : "?");
+
+    SeriesIndexEntry *index = malloc(header.chunk_count * sizeof(*index) + 1);
+    size_t frame_bytes = series_frame_bytes(&header);
+    size_t chunk_cap = frame_bytes * header.frames_per_chunk;
+    uint8_t *stored = malloc(ZRLE_BOUND(chunk_cap));
+    uint8_t *raw = malloc(chunk_cap);
+    size_t cells = (size_t)header.width * header.height;
+    size_t cell = header.quant_bits ? header.quant_bits / 8 : sizeof(float);
+    float *recon = calloc(cells, sizeof(float));
+    int status = 0;
+    fseek(f, header.index_offset, SEEK_SET);
+    if (!index || !stored || !raw || !recon ||
+        fread(index, sizeof(*index), header.chunk_count, f) != header.chunk_count) {
+        printf("%s: bad index\n", path);
+        status = 1;
+        goto done;
+    }
+
+    for (uint64_t c = 0; c < header.chunk_count; c++) {
+        SeriesChunkHeader ch;
+        fseek(f, index[c].offset, SEEK_SET);
+        if (fread(&ch, sizeof(ch), 1, f) != 1 || ch.magic != SERIES_CHUNK_MAGIC ||
+            ch.raw_bytes > chunk_cap || ch.stored_bytes > ZRLE_BOUND(chunk_cap) ||
+            fread(stored, 1, ch.stored_bytes, f) != ch.stored_bytes) {
+            printf("chunk %llu: corrupt\n", (unsigned long long)c);
+            status = 1;
+            goto done;
+        }
+        const uint8_t *p = stored;
+        if (header.compression == SERIES_ZRLE) {
+            if (zrle_decode(stored, ch.stored_bytes, raw, chunk_cap) != ch.raw_bytes) {
+                printf("chunk %llu: bad compression\n", (unsigned long long)c);
+                status = 1;
+                goto done;
+            }
+            p = raw;
+        }
+        const uint8_t *end = p + (header.compression == SERIES_DELTA ? ch.stored_bytes : ch.raw_bytes);
+        memset(recon, 0, cells * sizeof(float));
+
+        for (uint32_t k = 0; k < ch.frames; k++) {
+            SeriesFrameHeader fh;
+            if ((size_t)(end - p) < sizeof(fh)) {
+                printf("chunk %llu: frame %u truncated\n", (unsigned long long)c, k);
+                status = 1;
+                goto done;
+            }
+            memcpy(&fh, p, sizeof(fh));
+            p += sizeof(fh);
+            if (fh.bytes > (size_t)(end - p) ||
+                (header.compression != SERIES_DELTA && fh.bytes != cells * cell)) {
+                printf("chunk %llu: frame %u has a bad size\n", (unsigned long long)c, k);
+                status = 1;
+                goto done;
+            }
+            if (header.compression == SERIES_DELTA && !decode_field(p, fh.bytes, recon, cells, fh.scale)) {
+                printf("step %llu: bad delta frame\n", (unsigned long long)fh.step);
+                status = 1;
+                goto done;
+            }
+
+            double sum2 = 0.0, peak = 0.0;
+            for (size_t i = 0; i < cells; i++) {
+                float v;
+                if (header.compression == SERIES_DELTA) v = recon[i];
+                else if (header.quant_bits == 8) v = ((const int8_t *)p)[i] * fh.scale;
+                else if (header.quant_bits == 16) { int16_t q; memcpy(&q, p + 2 * i, 2); v = q * fh.scale; }
+                else memcpy(&v, p + 4 * i, 4);
+                sum2 += (double)v * v;
+                if (fabs(v) > peak) peak = fabs(v);
+            }
+            printf("step %10llu  rms %12.6g  peak %12.6g  chunk %llu (%.1f%% stored)\n",
+                   (unsigned long long)fh.step, sqrt(sum2 / cells), peak, (unsigned long long)c,
+                   100.0 * ch.stored_bytes / (ch.raw_bytes ? ch.raw_bytes : 1));
+            p += fh.bytes;
+        }
+    }
+
+    // every exit past the header goes through here
+done:
+    free(index);
+    free(stored);
+    free(raw);
+    free(recon);
+    fclose(f);
+    return status;
+}
+
+// plain compares instead of fminf/fmaxf, which gcc leaves as libm calls
+static inline float clampf(float v, float lo, float hi) {
+    return v < lo ? lo : (v > hi ? hi : v);
+}
+
+#define LAND_COLOR 0xFF5A4E3C
+
+// water color 
+uint32_t water_color(float height, float x, float y, Uint32 time) {
+    //color
+    float base_r = 0.1f;
+    float base_g = 0.2f;
+    float base_b = 0.4f;
+    
+    // wave effect
+    float wave_intensity = fabsf(height) * 2.0f;
+    
+    // foam
+    float foam = clampf((height - 0.3f) * 3.0f, 0.0f, 1.0f);
+    
+    // refelction
+    float light = clampf(height * 1.5f, 0.0f, 0.8f);
+    
+    // combine w,f,r
+    float r = base_r + foam + light * 0.3f;
+    float g = base_g + foam * 0.8f + light * 0.4f;
+    float b = base_b + foam + light * 0.2f;
+    
+    r = clampf(r, 0.0f, 1.0f);
+    g = clampf(g, 0.0f, 1.0f);
+    b = clampf(b, 0.0f, 1.0f);
+    
+    return ((uint32_t)(r * 255) << 16) | 
+           ((uint32_t)(g * 255) << 8) | 
+           ((uint32_t)(b * 255)) | 
+           0xFF000000;
+}
+
+uint32_t bw_water_color(float height) {
+    
+    float intensity = fabsf(height) * 3.0f;
+    
+    // Foam on wave peaks
+    if (height > 0.2f) {
+        float foam = (height - 0.2f) * 4.0f;
+        intensity -= foam * 0.5f; // Make peaks lighter (foam)
+    }
+    
+    intensity = fminf(fmaxf(intensity, 0.0f), 1.0f);
+    
+    uint8_t value = (uint8_t)((1.0f - intensity) * 255);
+    
+    return (0xFF << 24) | (value << 16) | (value << 8) | value;
+}
+
+#if DISPLAY_SCALE > 1
+// output pixels per pass, the column sums of one pass stay in L1
+#define DISPLAY_CHUNK 64
+#endif
+
+// r is in texture pixels. with DISPLAY_SCALE > 1 every pixel shows the mean height
+// of its block: the block's rows are summed down a chunk of columns (plain
+// contiguous adds the compiler vectorizes), then each group of columns
+static void colorize_rect(FluidRenderer *frenderer, const FluidGrid *fluid, SDL_Rect r, Uint32 time) {
+    #pragma omp parallel for schedule(static)
+    for (int y = r.y; y < r.y + r.h; y++) {
+#if DISPLAY_SCALE > 1
+        float sum[DISPLAY_CHUNK * DISPLAY_SCALE];
+        for (int x0 = r.x; x0 < r.x + r.w; x0 += DISPLAY_CHUNK) {
+            int n = r.x + r.w - x0 < DISPLAY_CHUNK ? r.x + r.w - x0 : DISPLAY_CHUNK;
+            int cols = n * DISPLAY_SCALE;
+            const cell_t *src = fluid->current + (size_t)y * DISPLAY_SCALE * GRID_WIDTH + (size_t)x0 * DISPLAY_SCALE;
+            for (int i = 0; i < cols; i++) sum[i] = CELL_LOAD(src[i]);
+            for (int k = 1; k < DISPLAY_SCALE; k++) {
+                src += GRID_WIDTH;
+                for (int i = 0; i < cols; i++) sum[i] += CELL_LOAD(src[i]);
+            }
+
+            uint32_t *dst = frenderer->pixels + (size_t)y * DISPLAY_WIDTH + x0;
+            for (int i = 0; i < n; i++) {
+                float height = 0.0f;
+                for (int k = 0; k < DISPLAY_SCALE; k++) height += sum[i * DISPLAY_SCALE + k];
+                dst[i] = water_color(height * (1.0f / (DISPLAY_SCALE * DISPLAY_SCALE)), x0 + i, y, time);
+            }
+        }
+#else
+        for (int x = r.x; x < r.x + r.w; x++) {
+            size_t idx = (size_t)y * GRID_WIDTH + x;
+            float height = CELL_LOAD(fluid->current[idx]);
+            
+            frenderer->pixels[idx] = water_color(height, x, y, time);  // Color
+        }
+#endif
+
+        // solid cells show as land, taken at the middle of each pixel's block
+        const ObstacleMask *m = fluid->obstacles;
+        int gy = y * DISPLAY_SCALE + DISPLAY_SCALE / 2;
+        if (m && m->rows[gy]) {
+            uint32_t *dst = frenderer->pixels + (size_t)y * DISPLAY_WIDTH;
+            for (int x = r.x; x < r.x + r.w; x++)
+                if (obstacle_at(m, x * DISPLAY_SCALE + DISPLAY_SCALE / 2, gy)) dst[x] = LAND_COLOR;
+        }
+    }
+}
+
+void update_fluid_texture(FluidRenderer *frenderer, FluidGrid *fluid, Uint32 time) {
+    SDL_Rect all = { 0, 0, DISPLAY_WIDTH, DISPLAY_HEIGHT };
+    colorize_rect(frenderer, fluid, all, time);
+    frenderer->dirty[0] = all;
+    frenderer->dirty_count = 1;
+    frenderer->drawn = 0;
+}
+
+// a separate upload costs about as much as copying this many extra pixels
+#define DIRTY_MERGE_PIXELS 8192
+
+// only redraws the cells that were active in this frame or the last one, per
+// band, from the boxes the solver gathers anyway. everything else is flat
+// water in both frames, so its pixels are already right
+void update_fluid_texture_dirty(FluidRenderer *frenderer, FluidGrid *fluid, Uint32 time) {
+    const FieldStats *stats = fluid->stats;
+    if (!stats || stats->threshold > DIRTY_THRESHOLD || !frenderer->drawn) {
+        update_fluid_texture(frenderer, fluid, time);
+        if (stats && stats->threshold <= DIRTY_THRESHOLD) {
+            memcpy(frenderer->shown, stats->view, sizeof(frenderer->shown));
+            frenderer->drawn = 1;
+        }
+        return;
+    }
+
+    int n = 0;
+    for (int b = 0; b < GRID_BANDS; b++) {
+        BandStats box = frenderer->shown[b];
+        merge_band_stats(&box, &stats->view[b]);
+        frenderer->shown[b] = stats->view[b];
+        if (box.x1 < box.x0) continue;
+
+        // the blocks holding the box. a block under the threshold everywhere
+        // averages under it too, so it stays flat water
+        int x0 = box.x0 / DISPLAY_SCALE, y0 = box.y0 / DISPLAY_SCALE;
+        int x1 = box.x1 / DISPLAY_SCALE, y1 = box.y1 / DISPLAY_SCALE;
+        if (x1 >= DISPLAY_WIDTH) x1 = DISPLAY_WIDTH - 1;
+        if (y1 >= DISPLAY_HEIGHT) y1 = DISPLAY_HEIGHT - 1;
+        if (x0 > x1 || y0 > y1) continue;
+
+        SDL_Rect r = { x0, y0, x1 - x0 + 1, y1 - y0 + 1 };
+        if (n > 0) {
+            // bands come top down, so only the last rect can be worth growing
+            SDL_Rect *last = &frenderer->dirty[n - 1];
+            int left = r.x < last->x ? r.x : last->x;
+            int right = r.x + r.w > last->x + last->w ? r.x + r.w : last->x + last->w;
+            int bottom = r.y + r.h > last->y + last->h ? r.y + r.h : last->y + last->h;
+            if ((int64_t)(right - left) * (bottom - last->y) <=
+                (int64_t)r.w * r.h + (int64_t)last->w * last->h + DIRTY_MERGE_PIXELS) {
+                last->x = left;
+                last->w = right - left;
+                last->h = bottom - last->y;
+                continue;
+            }
+        }
+        frenderer->dirty[n++] = r;
+    }
+    frenderer->dirty_count = n;
+
+    for (int i = 0; i < n; i++) colorize_rect(frenderer, fluid, frenderer->dirty[i], time);
+}
+
+void render_fluid(SDL_Renderer *renderer, FluidRenderer *frenderer, int upload) {
+
+    for (int i = 0; upload && i < frenderer->dirty_count; i++) {
+        const SDL_Rect *r = &frenderer->dirty[i];
+        SDL_UpdateTexture(frenderer->texture, r, frenderer->pixels + (size_t)r->y * DISPLAY_WIDTH + r->x,
+                          frenderer->pitch);
+    }
+    
+    // scale texture
+    SDL_RenderCopy(renderer, frenderer->texture, NULL, NULL);
+}
+
+// video export: colorized ARGB frames go through a queue to a thread that converts
+// them and writes YUV4MPEG2 (4:2:0, bt.601 studio range) or back to back binary PPMs,
+// to a file or to stdout for an external encoder
+enum {
+    EXPORT_Y4M,
+    EXPORT_PPM
+};
+#define EXPORT_QUEUE_FRAMES 4
+
+typedef struct {
+    FILE *file;
+    int format;
+    int every;
+    FrameQueue queue;
+    SDL_Thread *thread;
+    uint8_t *out;
+    size_t out_bytes;
+    unsigned long frames;
+    int failed;
+} VideoExporter;
+
+// plain per-channel integer loops, gcc vectorizes these at -O3
+static void argb_to_rgb_row(const uint32_t *src, uint8_t *dst, int w) {
+    for (int x = 0; x < w; x++) {
+        uint32_t p = src[x];
+        dst[3 * x + 0] = (uint8_t)(p >> 16);
+        dst[3 * x + 1] = (uint8_t)(p >> 8);
+        dst[3 * x + 2] = (uint8_t)p;
+    }
+}
+
+static void argb_to_luma_row(const uint32_t *src, uint8_t *dst, int w) {
+    for (int x = 0; x < w; x++) {
+        uint32_t p = src[x];
+        int r = (p >> 16) & 0xFF, g = (p >> 8) & 0xFF, b = p & 0xFF;
+        dst[x] = (uint8_t)(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+    }
+}
+
+// chroma from 2x2 averages; row1 is row0 again on an odd last row
+static void argb_to_chroma_row(const uint32_t *row0, const uint32_t *row1, uint8_t *u, uint8_t *v, int w) {
+    int pairs = w / 2;
+    for (int cx = 0; cx < pairs; cx++) {
+        uint32_t a = row0[2 * cx], b = row0[2 * cx + 1], c = row1[2 * cx], d = row1[2 * cx + 1];
+        int r = (((a >> 16) & 0xFF) + ((b >> 16) & 0xFF) + ((c >> 16) & 0xFF) + ((d >> 16) & 0xFF) + 2) >> 2;
+        int g = (((a >> 8) & 0xFF) + ((b >> 8) & 0xFF) + ((c >> 8) & 0xFF) + ((d >> 8) & 0xFF) + 2) >> 2;
+        int bl = ((a & 0xFF) + (b & 0xFF) + (c & 0xFF) + (d & 0xFF) + 2) >> 2;
+        u[cx] = (uint8_t)(((-38 * r - 74 * g + 112 * bl + 128) >> 8) + 128);
+        v[cx] = (uint8_t)(((112 * r - 94 * g - 18 * bl + 128) >> 8) + 128);
+    }
+    if (w & 1) {
+        uint32_t a = row0[w - 1], c = row1[w - 1];
+        int r = (((a >> 16) & 0xFF) + ((c >> 16) & 0xFF) + 1) >> 1;
+        int g = (((a >> 8) & 0xFF) + ((c >> 8) & 0xFF) + 1) >> 1;
+        int bl = ((a & 0xFF) + (c & 0xFF) + 1) >> 1;
+        u[pairs] = (uint8_t)(((-38 * r - 74 * g + 112 * bl + 128) >> 8) + 128);
+        v[pairs] = (uint8_t)(((112 * r - 94 * g - 18 * bl + 128) >> 8) + 128);
+    }
+}
+
+// converts one frame into w->out, returns its size including the per-frame header
+static size_t export_convert(VideoExporter *w, const uint32_t *pixels) {
+    int width = DISPLAY_WIDTH, height = DISPLAY_HEIGHT;
+    uint8_t *p = w->out;
+
+    if (w->format == EXPORT_PPM) {
+        p += sprintf((char *)p, "P6\n%d %d\n255\n", width, height);
+        for (int y = 0; y < height; y++)
+            argb_to_rgb_row(pixels + (size_t)y * width, p + (size_t)y * width * 3, width);
+        return p - w->out + (size_t)width * height * 3;
+    }
+
+    int cw = (width + 1) / 2, ch = (height + 1) / 2;
+    memcpy(p, "FRAME\n", 6);
+    p += 6;
+    uint8_t *y_plane = p;
+    uint8_t *u_plane = y_plane + (size_t)width * height;
+    uint8_t *v_plane = u_plane + (size_t)cw * ch;
+    for (int y = 0; y < height; y++)
+        argb_to_luma_row(pixels + (size_t)y * width, y_plane + (size_t)y * width, width);
+    for (int cy = 0; cy < ch; cy++) {
+        const uint32_t *row0 = pixels + (size_t)(2 * cy) * width;
+        const uint32_t *row1 = 2 * cy + 1 < height ? row0 + width : row0;
+        argb_to_chroma_row(row0, row1, u_plane + (size_t)cy * cw, v_plane + (size_t)cy * cw, width);
+    }
+    return 6 + (size_t)width * height + 2 * (size_t)cw * ch;
+}
+
+static int export_thread(void *data) {
+    VideoExporter *w = data;
+    uint8_t *frame;
+    size_t size;
+    uint64_t step;
+
+    while (frame_queue_pop(&w->queue, &frame, &size, &step)) {
+        // after a failed write the queue is only drained so the solver never blocks
+        if (w->failed) {
+            frame_queue_release(&w->queue);
+            continue;
+        }
+        size_t n = export_convert(w, (const uint32_t *)frame);
+        frame_queue_release(&w->queue);
+        if (fwrite(w->out, 1, n, w->file) != n) {
+            printf("Failed to write video frame, export stopped\n");
+            w->failed = 1;
+            continue;
+        }
+        w->frames++;
+    }
+    fflush(w->file);
+    return 0;
+}
+
+// path "-" writes to stdout; the solver's own output then moves to stderr
+int open_exporter(VideoExporter *w, const char *path, int format, int every, int fps) {
+    memset(w, 0, sizeof(*w));
+    w->format = format;
+    w->every = every > 0 ? every : 1;
+
+    if (strcmp(path, "-") == 0) {
+        fflush(stdout);
+        int fd = dup(STDOUT_FILENO);
+        w->file = fd >= 0 ? fdopen(fd, "wb") : NULL;
+        if (w->file) dup2(STDERR_FILENO, STDOUT_FILENO);
+    } else {
+        w->file = fopen(path, "wb");
+    }
+
+    w->out_bytes = 64 + DISPLAY_CELLS * 3;
+    w->out = malloc(w->out_bytes);
+    if (!w->file || !w->out ||
+        !init_frame_queue(&w->queue, EXPORT_QUEUE_FRAMES, DISPLAY_CELLS * sizeof(uint32_t))) {
+        printf("Failed to open video export %s\n", path);
+        return 0;
+    }
+    if (format == EXPORT_Y4M) {
+        fprintf(w->file, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n", DISPLAY_WIDTH, DISPLAY_HEIGHT,
+                fps > 0 ? fps : 60);
+    }
+
+    w->thread = SDL_CreateThread(export_thread, "export", w);
+    if (!w->thread) {
+        printf("Failed to start video export\n");
+        return 0;
+    }
+    return 1;
+}
+
+// waits for a free slot rather than dropping, so the video has every frame
+void export_push(VideoExporter *w, const FluidRenderer *frenderer, uint64_t step) {
+    if (!w->file || step % w->every != 0) return;
+
+    uint8_t *slot = frame_queue_begin_push(&w->queue, 1);
+    if (!slot) return;
+    memcpy(slot, frenderer->pixels, DISPLAY_CELLS * sizeof(uint32_t));
+    frame_queue_end_push(&w->queue, DISPLAY_CELLS * sizeof(uint32_t), step);
+}
+
+void close_exporter(VideoExporter *w) {
+    if (!w->file) return;
+
+    frame_queue_close(&w->queue);
+    if (w->thread) SDL_WaitThread(w->thread, NULL);
+    fclose(w->file);
+    printf("exported %lu frames\n", w->frames);
+
+    free_frame_queue(&w->queue);
+    free(w->out);
+    memset(w, 0, sizeof(*w));
+}
+
+// publisher side of fluid_shm.h: copies each step into the next ring slot under
+// its seqlock and never waits for readers
+typedef struct {
+    FluidShmHeader *header;
+    char name[64];
+} FluidShm;
+
+int open_shm(FluidShm *shm, const char *name) {
+    memset(shm, 0, sizeof(*shm));
+    // close_shm unlinks the stored copy, a cut one would name another object
+    if (strlen(name) >= sizeof(shm->name)) {
+        printf("Shared memory name %s is too long, at most %zu characters\n", name, sizeof(shm->name) - 1);
+        return 0;
+    }
+
+    // a fresh object each run, readers still holding the old one keep their mapping
+    shm_unlink(name);
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0) {
+        printf("Failed to create shared memory %s\n", name);
+        return 0;
+    }
+
+    FluidShmHeader layout;
+    fluid_shm_layout(&layout, GRID_WIDTH, GRID_HEIGHT);
+    void *base = MAP_FAILED;
+    if (ftruncate(fd, layout.size) == 0) {
+        base = mmap(NULL, layout.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (base == MAP_FAILED) {
+        printf("Failed to map shared memory %s\n", name);
+        shm_unlink(name);
+        return 0;
+    }
+
+    memcpy(base, &layout, sizeof(layout));
+    shm->header = base;
+    snprintf(shm->name, sizeof(shm->name), "%s", name);
+    return 1;
+}
+
+void shm_publish(FluidShm *shm, const FluidGrid *fluid) {
+    FluidShmHeader *header = shm->header;
+    if (!header) return;
+
+    uint64_t frame = atomic_load_explicit(&header->published, memory_order_relaxed);
+    int slot = (int)(frame % FLUID_SHM_SLOTS);
+    FluidShmSlot *s = &header->slot[slot];
+    uint64_t seq = atomic_load_explicit(&s->seq, memory_order_relaxed);
+
+    atomic_store_explicit(&s->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    load_field(fluid, fluid_shm_field(header, slot));
+    s->step = fluid->step;
+    s->frame = frame;
+    atomic_store_explicit(&s->seq, seq + 2, memory_order_release);
+    atomic_store_explicit(&header->published, frame + 1, memory_order_release);
+}
+
+void close_shm(FluidShm *shm) {
+    if (!shm->header) return;
+    munmap(shm->header, shm->header->size);
+    shm_unlink(shm->name);
+    memset(shm, 0, sizeof(*shm));
+}
+
+// frame streaming for remote viewers: hello once, then a header and a delta coded,
+// downscaled field per frame. the solver only drops its newest frame in a mailbox;
+// each client has a thread that sends the newest one whenever its socket drains,
+// so a slow viewer skips frames instead of holding up the solver
+#define STREAM_MAGIC 0x54534C46  // "FLST"
+#define STREAM_VERSION 1
+#define STREAM_MAX_CLIENTS 8
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t width;             // of the streamed field
+    uint32_t height;
+    uint32_t scale;             // grid cells per streamed cell, each way
+    uint32_t reserved;
+} StreamHello;
+
+typedef struct {
+    uint64_t step;
+    float error_bound;
+    uint32_t bytes;
+} StreamFrameHeader;
+
+typedef struct StreamServer StreamServer;
+
+typedef struct {
+    StreamServer *server;
+    int fd;
+    SDL_Thread *thread;
+    SDL_atomic_t done;
+    unsigned long sent;
+    unsigned long skipped;
+} StreamClient;
+
+struct StreamServer {
+    int listen_fd;
+    char unix_path[108];
+    int scale;
+    int width;
+    int height;
+    float error_bound;
+    SDL_Thread *accept_thread;
+    SDL_mutex *lock;
+    SDL_cond *fresh;
+    float *mailbox;             // newest frame, swapped with scratch under the lock
+    float *scratch;
+    uint64_t mailbox_seq;
+    uint64_t mailbox_step;
+    int closed;
+    SDL_atomic_t clients;
+    StreamClient client[STREAM_MAX_CLIENTS];
+};
+
+static int send_all(int fd, const void *data, size_t size) {
+    const uint8_t *p = data;
+    while (size > 0) {
+        ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        p += n;
+        size -= n;
+    }
+    return 1;
+}
+
+static int recv_all(int fd, void *data, size_t size) {
+    uint8_t *p = data;
+    while (size > 0) {
+        ssize_t n = recv(fd, p, size, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        p += n;
+        size -= n;
+    }
+    return 1;
+}
+
+// "host:port" or ":port" is tcp. a path starting with / or ., or anything
+// without a colon, is a unix socket. "tcp:" and "unix:" say which explicitly.
+// listening sockets remember a unix path so it can be removed on close
+static int stream_socket(const char *addr, int listening, char *unix_path) {
+    int tcp;
+    if (strncmp(addr, "unix:", 5) == 0) {
+        addr += 5;
+        tcp = 0;
+    } else if (strncmp(addr, "tcp:", 4) == 0) {
+        addr += 4;
+        tcp = 1;
+    } else {
+        tcp = strchr(addr, ':') && addr[0] != '/' && addr[0] != '.';
+    }
+    const char *colon = strrchr(addr, ':');
+    int fd = -1;
+
+    if (tcp) {
+        if (!colon) return -1;
+        char host[256];
+        snprintf(host, sizeof(host), "%.*s", (int)(colon - addr), addr);
+        struct addrinfo hints = {0}, *res = NULL;
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = listening ? AI_PASSIVE : 0;
+        if (getaddrinfo(host[0] ? host : NULL, colon + 1, &hints, &res) != 0) return -1;
+        for (struct addrinfo *ai = res; ai && fd < 0; ai = ai->ai_next) {
+            fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (fd < 0) continue;
+            int one = 1;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            int ok = listening ? bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 4) == 0
+                               : connect(fd, ai->ai_addr, ai->ai_addrlen) == 0;
+            if (!ok) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        freeaddrinfo(res);
+        if (fd >= 0) {
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+        return fd;
+    }
+
+    struct sockaddr_un sa = {0};
+    sa.sun_family = AF_UNIX;
+    if (strlen(addr) >= sizeof(sa.sun_path)) return -1;
+    strcpy(sa.sun_path, addr);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (listening) {
+        unlink(addr);
+        if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0 || listen(fd, 4) != 0) {
+            close(fd);
+            return -1;
+        }
+        snprintf(unix_path, sizeof(sa.sun_path), "%s", addr);
+    } else if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int stream_client_thread(void *data) {
+    StreamClient *c = data;
+    StreamServer *s = c->server;
+    size_t cells = (size_t)s->width * s->height;
+
+    float *field = malloc(cells * sizeof(float));
+    float *recon = calloc(cells, sizeof(float));     // what the viewer has decoded so far
+    uint8_t *buf = malloc(sizeof(StreamFrameHeader) + CODEC_BOUND(cells, sizeof(float)));
+    StreamHello hello = { STREAM_MAGIC, STREAM_VERSION, s->width, s->height, s->scale, 0 };
+    int ok = field && recon && buf && send_all(c->fd, &hello, sizeof(hello));
+    uint64_t seen = 0;
+
+    while (ok) {
+        SDL_LockMutex(s->lock);
+        while (s->mailbox_seq == seen && !s->closed) {
+            SDL_CondWait(s->fresh, s->lock);
+        }
+        if (s->closed) {
+            SDL_UnlockMutex(s->lock);
+            break;
+        }
+        if (seen && s->mailbox_seq > seen + 1) c->skipped += s->mailbox_seq - seen - 1;
+        seen = s->mailbox_seq;
+        memcpy(field, s->mailbox, cells * sizeof(float));
+        StreamFrameHeader fh = { s->mailbox_step, s->error_bound, 0 };
+        SDL_UnlockMutex(s->lock);
+
+        // a tcp stream delivers every frame we send, so recon stays in step with the viewer
+        fh.bytes = encode_field(field, recon, cells, s->error_bound, buf + sizeof(fh));
+        memcpy(buf, &fh, sizeof(fh));
+        ok = send_all(c->fd, buf, sizeof(fh) + fh.bytes);
+        if (ok) c->sent++;
+    }
+
+    free(field);
+    free(recon);
+    free(buf);
+    SDL_AtomicAdd(&s->clients, -1);
+    SDL_AtomicSet(&c->done, 1);
+    return 0;
+}
+
+static void stream_reap(StreamClient *c) {
+    SDL_WaitThread(c->thread, NULL);
+    close(c->fd);
+    printf("viewer left: %lu frames sent, %lu skipped\n", c->sent, c->skipped);
+    c->thread = NULL;
+}
+
+static int stream_accept_thread(void *data) {
+    StreamServer *s = data;
+
+    for (;;) {
+        int fd = accept(s->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            break;
+        }
+
+        StreamClient *c = NULL;
+        for (int i = 0; i < STREAM_MAX_CLIENTS && !c; i++) {
+            StreamClient *slot = &s->client[i];
+            if (slot->thread && SDL_AtomicGet(&slot->done)) stream_reap(slot);
+            if (!slot->thread) c = slot;
+        }
+        if (!c) {
+            close(fd);
+            continue;
+        }
+
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        memset(c, 0, sizeof(*c));
+        c->server = s;
+        c->fd = fd;
+        SDL_AtomicAdd(&s->clients, 1);
+        c->thread = SDL_CreateThread(stream_client_thread, "stream client", c);
+        if (!c->thread) {
+            SDL_AtomicAdd(&s->clients, -1);
+            close(fd);
+        }
+    }
+    return 0;
+}
+
+int open_server(StreamServer *s, const char *addr, int scale, float error_bound) {
+    memset(s, 0, sizeof(*s));
+    s->scale = scale > 0 ? scale : 1;
+    s->width = GRID_WIDTH / s->scale;
+    s->height = GRID_HEIGHT / s->scale;
+    s->error_bound = error_bound;
+
+    size_t cells = (size_t)s->width * s->height;
+    s->mailbox = malloc(cells * sizeof(float));
+    s->scratch = malloc(cells * sizeof(float));
+    s->lock = SDL_CreateMutex();
+    s->fresh = SDL_CreateCond();
+    s->listen_fd = stream_socket(addr, 1, s->unix_path);
+    if (!s->mailbox || !s->scratch || !s->lock || !s->fresh || s->listen_fd < 0) {
+        printf("Failed to listen on %s\n", addr);
+        return 0;
+    }
+
+    s->accept_thread = SDL_CreateThread(stream_accept_thread, "stream accept", s);
+    if (!s->accept_thread) {
+        printf("Failed to start stream server\n");
+        return 0;
+    }
+    printf("streaming %dx%d frames on %s\n", s->width, s->height, addr);
+    return 1;
+}
+
+// box average of scale x scale blocks
+static void downscale_field(const FluidGrid *fluid, float *dst, int scale, int width, int height) {
+    float norm = 1.0f / (scale * scale);
+    #pragma omp parallel for schedule(static)
+    for (int y = 0; y < height; y++) {
+        float *out = dst + (size_t)y * width;
+        for (int x = 0; x < width; x++) out[x] = 0.0f;
+        for (int dy = 0; dy < scale; dy++) {
+            const cell_t *row = fluid->current + (size_t)(y * scale + dy) * GRID_WIDTH;
+            for (int x = 0; x < width; x++) {
+                for (int dx = 0; dx < scale; dx++) out[x] += CELL_LOAD(row[x * scale + dx]);
+            }
+        }
+        for (int x = 0; x < width; x++) out[x] *= norm;
+    }
+}
+
+// called after update_fluid, costs one downscale pass and only while someone watches
+void stream_publish(StreamServer *s, const FluidGrid *fluid) {
+    if (!s->accept_thread || SDL_AtomicGet(&s->clients) == 0) return;
+
+    downscale_field(fluid, s->scratch, s->scale, s->width, s->height);
+    SDL_LockMutex(s->lock);
+    float *temp = s->mailbox;
+    s->mailbox = s->scratch;
+    s->scratch = temp;
+    s->mailbox_seq++;
+    s->mailbox_step = fluid->step;
+    SDL_CondBroadcast(s->fresh);
+    SDL_UnlockMutex(s->lock);
+}
+
+void close_server(StreamServer *s) {
+    if (!s->accept_thread) return;
+
+    SDL_LockMutex(s->lock);
+    s->closed = 1;
+    SDL_CondBroadcast(s->fresh);
+    SDL_UnlockMutex(s->lock);
+
+    shutdown(s->listen_fd, SHUT_RDWR);
+    SDL_WaitThread(s->accept_thread, NULL);
+    close(s->listen_fd);
+    for (int i = 0; i < STREAM_MAX_CLIENTS; i++) {
+        StreamClient *c = &s->client[i];
+        if (!c->thread) continue;
+        shutdown(c->fd, SHUT_RDWR);   // unblocks a send stuck on a stalled viewer
+        stream_reap(c);
+    }
+    if (s->unix_path[0]) unlink(s->unix_path);
+
+    SDL_DestroyCond(s->fresh);
+    SDL_DestroyMutex(s->lock);
+    free(s->mailbox);
+    free(s->scratch);
+    memset(s, 0, sizeof(*s));
+}
+
+void default_options(FluidOptions *opts) {
+    memset(opts, 0, sizeof(*opts));
+    opts->frames = 1000;
+    opts->damping = 0.99f;
+    opts->checkpoint_path = CHECKPOINT_PATH;
+    opts->series_every = 1;
+    opts->series_chunk = 16;
+    opts->export_every = 1;
+    opts->export_fps = 60;
+    opts->serve_scale = 2;
+    opts->serve_error = 1e-3f;
+    opts->sweep_damping_lo = 0.99f;
+    opts->sweep_damping_hi = 0.99f;
+    opts->sweep_damping_count = 1;
+    opts->sweep_sizes = "64";
+    opts->sweep_patterns = "drop";
+    opts->sweep_seeds = 1;
+    opts->ensemble_out = "ensemble.csv";
+    opts->probe_out = "probes.csv";
+    opts->probe_frames = 4096;
+    opts->stats_threshold = DIRTY_THRESHOLD;
+    opts->idle_after = -1;
+    opts->idle_energy = 1e-3f;
+    opts->sponge_width = SPONGE_WIDTH;
+    opts->sponge_strength = SPONGE_STRENGTH;
+    opts->depth_scale = 1.0f;
+    opts->damping_map_loss = DAMPING_LOSS;
+    opts->storm.seed = 1;
+    opts->storm.rain_rate = 2.0f;
+    opts->storm.rain_intensity = 20.0f;
+    opts->storm.boats = 0;
+    opts->storm.boat_speed = 1.5f;
+    opts->storm.boat_intensity = 4.0f;
+    opts->storm.wave_makers = 0;
+    opts->storm.wave_period = 60;
+    opts->storm.wave_intensity = 2.0f;
+}
+
+void print_usage(const char *prog) {
+    printf("usage: %s [options]\n", prog);
+    printf("  --headless         run without a window and print timings\n");
+    printf("  --frames N         frames to run headless (default 1000)\n");
+    printf("  --seed N           storm random seed\n");
+    printf("  --rain R           mean raindrops per frame (enables storm)\n");
+    printf("  --boats N          moving boats as line sources (enables storm)\n");
+    printf("  --wave-makers N    sine wave makers on N boundary edges (enables storm)\n");
+    printf("  --wave-period N    frames per wave maker cycle\n");
+    printf("  --oscillators N    register N point oscillators on a lattice\n");
+    printf("  --damping D        per step damping (default 0.99, + and - in the window)\n");
+    printf("  --damping-model M  height (default) or velocity, what the damping takes off (M in the window)\n");
+    printf("  --damping-map FILE pgm image, dark pixels damp more (shallows, absorbing zones)\n");
+    printf("  --damping-map-loss L  extra loss per step at black (default %g)\n", DAMPING_LOSS);
+    printf("  --drift N          run N steps next to float32/float64 references and report error\n");
+    printf("  --checkpoint PATH  checkpoint file for K/L and --checkpoint-every (default %s)\n", CHECKPOINT_PATH);
+    printf("  --checkpoint-every N  write a checkpoint every N steps in the background\n");
+    printf("  --restore PATH     start from a checkpoint\n");
+    printf("  --backing PATH     keep the grid in a memory-mapped file (resumes if it exists)\n");
+    printf("  --series PATH      stream height fields to a time-series file\n");
+    printf("  --series-every N   keep every Nth step (default 1)\n");
+    printf("  --series-bits B    quantize to 8 or 16 bits (default float32)\n");
+    printf("  --series-compress  zero run-length compress each chunk\n");
+    printf("  --series-delta E   delta code frames to within E (0 lossless)\n");
+    printf("  --series-chunk N   frames per chunk (default 16)\n");
+    printf("  --series-dump PATH print every frame of a time-series file\n");
+    printf("  --checkpoint-compress  delta code checkpoints (smaller, not mappable)\n");
+    printf("  --codec-bench N    compare frame codecs over N storm frames\n");
+    printf("  --stencil-bench N  phase error of both stencils, then time N steps of this build\n");
+    printf("  --export PATH      write colorized frames as video, - for stdout\n");
+    printf("  --export-format F  y4m (default) or ppm\n");
+    printf("  --export-every N   export every Nth step (default 1)\n");
+    printf("  --export-fps N     frame rate in the y4m header (default 60)\n");
+    printf("  --shm NAME         publish every step to a shared memory ring (e.g. %s)\n", FLUID_SHM_NAME);
+    printf("  --serve ADDR       stream frames to viewers on a unix socket path or [host]:port\n");
+    printf("  --serve-scale N    downscale streamed frames N times each way (default 2)\n");
+    printf("  --serve-error E    delta code streamed frames to within E (default 1e-3, 0 lossless)\n");
+    printf("  --view ADDR        watch a --serve instance (prints frames with --headless)\n");
+    printf("  --ensemble STEPS   run a parameter sweep of small grids for STEPS steps each\n");
+    printf("  --sweep-damping LO:HI:N  N dampings from LO to HI (default 0.99:0.99:1)\n");
+    printf("  --sweep-size LIST  grid sizes, e.g. 32,64,128x96 (default 64)\n");
+    printf("  --sweep-pattern LIST  any of drop,ring,line,rain (default drop)\n");
+    printf("  --sweep-seeds N    seeds per combination, from --seed up (default 1)\n");
+    printf("  --ensemble-out PATH  results csv (default ensemble.csv)\n");
+    printf("  --ensemble-layout L  batch (members interleaved, default), single, or check to run both and compare\n");
+    printf("  --probes FILE      record the height at the \"x y\" points listed in FILE\n");
+    printf("  --probe-grid NxM   record an N by M lattice of probes\n");
+    printf("  --probe-out PATH   probe samples at exit, .csv or binary (default probes.csv)\n");
+    printf("  --probe-frames N   steps of probe samples kept (default 4096)\n");
+    printf("  --stats-every N    print energy, peak and active area every N steps\n");
+    printf("  --stats-threshold T  height that counts as active (default %g, the least visible)\n",
+           DIRTY_THRESHOLD);
+    printf("  --idle-after K     settle and stop stepping after K quiet steps (window default %d, 0 off)\n",
+           IDLE_AFTER);
+    printf("  --idle-energy E    energy that counts as quiet (default 1e-3)\n");
+    printf("  --smooth           filter the picture linearly when it is stretched to the window\n");
+    printf("  --boundary B       wall (default), open, sponge or periodic edges\n");
+    printf("  --sponge N         sponge cells inside each edge (default %d, at most %d)\n", SPONGE_WIDTH, SPONGE_MAX);
+    printf("  --sponge-strength S  damping next to the edge (default %g)\n", SPONGE_STRENGTH);
+    printf("  --obstacles FILE   pgm image, dark pixels are solid (walls, piers, islands)\n");
+    printf("  --depth FILE       pgm depth image, waves slow down where it is dark\n");
+    printf("  --depth-scale S    squared wave speed at white relative to the default (default 1, below 2)\n");
+}
+
+static const char *boundary_names[BOUNDARY_MODES] = { "wall", "open", "sponge", "periodic" };
+
+int parse_boundary(const char *name) {
+    for (int i = 0; i < BOUNDARY_MODES; i++)
+        if (strcmp(name, boundary_names[i]) == 0) return i;
+    return -1;
+}
+
+// the periodic halo is one cell deep, the 13 point stencil reaches two
+int boundary_supported(int mode) {
+    return !(mode == BOUNDARY_PERIODIC && FLUID_STENCIL == STENCIL_13);
+}
+
+static const char *damping_model_names[DAMPING_MODELS] = { "height", "velocity" };
+
+int parse_damping_model(const char *name) {
+    for (int i = 0; i < DAMPING_MODELS; i++)
+        if (strcmp(name, damping_model_names[i]) == 0) return i;
+    return -1;
+}
+
+// how --ensemble runs its members
+typedef enum {
+    LAYOUT_BATCH,       // interleaved in a GridBatch
+    LAYOUT_SINGLE,      // one at a time on their own buffers
+    LAYOUT_CHECK,       // both, and compare
+    LAYOUTS
+} EnsembleLayout;
+
+static const char *layout_names[LAYOUTS] = { "batch", "single", "check" };
+
+int parse_layout(const char *name) {
+    for (int i = 0; i < LAYOUTS; i++)
+        if (strcmp(name, layout_names[i]) == 0) return i;
+    return -1;
+}
+
+int parse_options(int argc, char **argv, FluidOptions *opts) {
+    default_options(opts);
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *val = i + 1 < argc ? argv[i + 1] : NULL;
+
+        if (strcmp(arg, "--headless") == 0) {
+            opts->headless = 1;
+        } else if (strcmp(arg, "--frames") == 0 && val) {
+            opts->frames = atoi(val); i++;
+        } else if (strcmp(arg, "--seed") == 0 && val) {
+            opts->storm.seed = strtoull(val, NULL, 10); i++;
+        } else if (strcmp(arg, "--rain") == 0 && val) {
+            opts->storm.rain_rate = atof(val); i++;
+            opts->storm_enabled = 1;
+        } else if (strcmp(arg, "--boats") == 0 && val) {
+            opts->storm.boats = atoi(val); i++;
+            opts->storm_enabled = 1;
+        } else if (strcmp(arg, "--wave-makers") == 0 && val) {
+            opts->storm.wave_makers = atoi(val); i++;
+            opts->storm_enabled = 1;
+        } else if (strcmp(arg, "--wave-period") == 0 && val) {
+            opts->storm.wave_period = atoi(val); i++;
+        } else if (strcmp(arg, "--oscillators") == 0 && val) {
+            opts->oscillators = atoi(val); i++;
+        } else if (strcmp(arg, "--damping") == 0 && val) {
+            opts->damping = atof(val); i++;
+            opts->damping_given = 1;
+        } else if (strcmp(arg, "--drift") == 0 && val) {
+            opts->drift_steps = atoi(val); i++;
+        } else if (strcmp(arg, "--checkpoint") == 0 && val) {
+            opts->checkpoint_path = val; i++;
+        } else if (strcmp(arg, "--checkpoint-every") == 0 && val) {
+            opts->checkpoint_every = atoi(val); i++;
+        } else if (strcmp(arg, "--restore") == 0 && val) {
+            opts->restore_path = val; i++;
+        } else if (strcmp(arg, "--backing") == 0 && val) {
+            opts->backing_path = val; i++;
+        } else if (strcmp(arg, "--series") == 0 && val) {
+            opts->series_path = val; i++;
+        } else if (strcmp(arg, "--series-every") == 0 && val) {
+            opts->series_every = atoi(val); i++;
+        } else if (strcmp(arg, "--series-bits") == 0 && val) {
+            opts->series_bits = atoi(val); i++;
+        } else if (strcmp(arg, "--series-compress") == 0) {
+            opts->series_codec = SERIES_ZRLE;
+        } else if (strcmp(arg, "--series-delta") == 0 && val) {
+            opts->series_codec = SERIES_DELTA;
+            opts->series_error = atof(val); i++;
+        } else if (strcmp(arg, "--series-chunk") == 0 && val) {
+            opts->series_chunk = atoi(val); i++;
+        } else if (strcmp(arg, "--series-dump") == 0 && val) {
+            opts->series_dump = val; i++;
+        } else if (strcmp(arg, "--checkpoint-compress") == 0) {
+            opts->checkpoint_compress = 1;
+        } else if (strcmp(arg, "--codec-bench") == 0 && val) {
+            opts->codec_bench = atoi(val); i++;
+        } else if (strcmp(arg, "--stencil-bench") == 0 && val) {
+            opts->stencil_bench = atoi(val); i++;
+        } else if (strcmp(arg, "--export") == 0 && val) {
+            opts->export_path = val; i++;
+        } else if (strcmp(arg, "--export-format") == 0 && val) {
+            opts->export_format = strcmp(val, "ppm") == 0 ? EXPORT_PPM : EXPORT_Y4M; i++;
+        } else if (strcmp(arg, "--export-every") == 0 && val) {
+            opts->export_every = atoi(val); i++;
+        } else if (strcmp(arg, "--export-fps") == 0 && val) {
+            opts->export_fps = atoi(val); i++;
+        } else if (strcmp(arg, "--shm") == 0 && val) {
+            opts->shm_name = val; i++;
+        } else if (strcmp(arg, "--serve") == 0 && val) {
+            opts->serve_addr = val; i++;
+        } else if (strcmp(arg, "--serve-scale") == 0 && val) {
+            opts->serve_scale = atoi(val); i++;
+        } else if (strcmp(arg, "--serve-error") == 0 && val) {
+            opts->serve_error = atof(val); i++;
+        } else if (strcmp(arg, "--view") == 0 && val) {
+            opts->view_addr = val; i++;
+        } else if (strcmp(arg, "--ensemble") == 0 && val) {
+            opts->ensemble_steps = atoi(val); i++;
+        } else if (strcmp(arg, "--sweep-damping") == 0 && val) {
+            float lo = opts->sweep_damping_lo, hi = opts->sweep_damping_hi;
+            int n = 1;
+            int got = sscanf(val, "%f:%f:%d", &lo, &hi, &n);
+            if (got == 1) hi = lo;
+            opts->sweep_damping_lo = lo;
+            opts->sweep_damping_hi = hi;
+            opts->sweep_damping_count = n;
+            i++;
+        } else if (strcmp(arg, "--sweep-size") == 0 && val) {
+            opts->sweep_sizes = val; i++;
+        } else if (strcmp(arg, "--sweep-pattern") == 0 && val) {
+            opts->sweep_patterns = val; i++;
+        } else if (strcmp(arg, "--sweep-seeds") == 0 && val) {
+            opts->sweep_seeds = atoi(val); i++;
+        } else if (strcmp(arg, "--ensemble-out") == 0 && val) {
+            opts->ensemble_out = val; i++;
+        } else if (strcmp(arg, "--ensemble-layout") == 0 && val) {
+            opts->ensemble_layout = parse_layout(val); i++;
+            if (opts->ensemble_layout < 0) {
+                printf("unknown ensemble layout %s\n", val);
+                return 0;
+            }
+        } else if (strcmp(arg, "--probes") == 0 && val) {
+            opts->probe_path = val; i++;
+        } else if (strcmp(arg, "--probe-grid") == 0 && val) {
+            if (sscanf(val, "%dx%d", &opts->probe_grid_x, &opts->probe_grid_y) != 2) {
+                opts->probe_grid_x = opts->probe_grid_y = atoi(val);
+            }
+            i++;
+        } else if (strcmp(arg, "--probe-out") == 0 && val) {
+            opts->probe_out = val; i++;
+        } else if (strcmp(arg, "--probe-frames") == 0 && val) {
+            opts->probe_frames = atoi(val); i++;
+        } else if (strcmp(arg, "--stats-every") == 0 && val) {
+            opts->stats_every = atoi(val); i++;
+        } else if (strcmp(arg, "--stats-threshold") == 0 && val) {
+            opts->stats_threshold = atof(val); i++;
+        } else if (strcmp(arg, "--idle-after") == 0 && val) {
+            opts->idle_after = atoi(val); i++;
+        } else if (strcmp(arg, "--idle-energy") == 0 && val) {
+            opts->idle_energy = atof(val); i++;
+        } else if (strcmp(arg, "--smooth") == 0) {
+            opts->smooth = 1;
+        } else if (strcmp(arg, "--boundary") == 0 && val) {
+            opts->boundary = parse_boundary(val); i++;
+            if (opts->boundary < 0) {
+                printf("unknown boundary %s\n", val);
+                return 0;
+            }
+            if (!boundary_supported(opts->boundary)) {
+                printf("--boundary periodic needs the 5 point stencil, this build has the 13 point one\n");
+                return 0;
+            }
+        } else if (strcmp(arg, "--sponge") == 0 && val) {
+            opts->sponge_width = atoi(val); i++;
+        } else if (strcmp(arg, "--sponge-strength") == 0 && val) {
+            opts->sponge_strength = atof(val); i++;
+        } else if (strcmp(arg, "--obstacles") == 0 && val) {
+            opts->obstacle_path = val; i++;
+        } else if (strcmp(arg, "--depth") == 0 && val) {
+            opts->depth_path = val; i++;
+        } else if (strcmp(arg, "--depth-scale") == 0 && val) {
+            opts->depth_scale = atof(val); i++;
+        } else if (strcmp(arg, "--damping-model") == 0 && val) {
+            opts->damping_model = parse_damping_model(val); i++;
+            if (opts->damping_model < 0) {
+                printf("unknown damping model %s\n", val);
+                return 0;
+            }
+            opts->damping_model_given = 1;
+        } else if (strcmp(arg, "--damping-map") == 0 && val) {
+            opts->damping_map_path = val; i++;
+        } else if (strcmp(arg, "--damping-map-loss") == 0 && val) {
+            opts->damping_map_loss = atof(val); i++;
+        } else {
+            print_usage(argv[0]);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int open_series_from_options(SeriesWriter *series, const FluidOptions *opts) {
+    memset(series, 0, sizeof(*series));
+    if (!opts->series_path) return 1;
+    return open_series(series, opts->series_path, opts->series_every, opts->series_bits,
+                       opts->series_codec, opts->series_error, opts->series_chunk);
+}
+
+int open_probes_from_options(ProbeSet *probes, const FluidOptions *opts) {
+    memset(probes, 0, sizeof(*probes));
+    if (opts->probe_path && !load_probes(probes, opts->probe_path)) return 0;
+    if (opts->probe_grid_x > 0 && opts->probe_grid_y > 0 &&
+        !add_probe_grid(probes, opts->probe_grid_x, opts->probe_grid_y)) return 0;
+    return start_probes(probes, opts->probe_frames);
+}
+
+int open_obstacles_from_options(ObstacleMask *obstacles, const FluidOptions *opts) {
+    memset(obstacles, 0, sizeof(*obstacles));
+    if (!opts->obstacle_path) return 1;
+    if (!load_obstacles(obstacles, opts->obstacle_path)) return 0;
+    printf("%lld solid cells from %s\n", (long long)obstacles->solid, opts->obstacle_path);
+    return 1;
+}
+
+int open_speed_from_options(SpeedMap *speed, const FluidOptions *opts) {
+    memset(speed, 0, sizeof(*speed));
+    if (!opts->depth_path) return 1;
+    if (!(opts->depth_scale > 0.0f && opts->depth_scale < 2.0f)) {
+        printf("--depth-scale must be above 0 and below 2, faster waves are unstable\n");
+        return 0;
+    }
+    return load_depth(speed, opts->depth_path, opts->depth_scale);
+}
+
+// a backing file already holds the damping it was left with (+, - and M), a new
+// one the defaults
+void damping_from_options(FluidGrid *fluid, const FluidOptions *opts) {
+    if (!fluid->backing || opts->damping_given) fluid->damping = opts->damping;
+    if (!fluid->backing || opts->damping_model_given) fluid->damping_model = opts->damping_model;
+}
+
+int open_damping_map_from_options(DampingMap *map, const FluidOptions *opts) {
+    memset(map, 0, sizeof(*map));
+    if (!opts->damping_map_path) return 1;
+    if (!(opts->damping_map_loss >= 0.0f && opts->damping_map_loss <= 1.0f)) {
+        printf("--damping-map-loss must be between 0 and 1\n");
+        return 0;
+    }
+    return load_damping_map(map, opts->damping_map_path, opts->damping_map_loss);
+}
+
+void close_probes(ProbeSet *probes, const char *path) {
+    if (probes->count > 0 && write_probes(probes, path)) {
+        uint64_t kept = probes->recorded < (uint64_t)probes->frames ? probes->recorded
+                                                                    : (uint64_t)probes->frames;
+        printf("%d probes, %llu of %llu steps written to %s\n", probes->count,
+               (unsigned long long)kept, (unsigned long long)probes->recorded, path);
+    }
+    free_probes(probes);
+}
+
+void init_stats_from_options(FieldStats *stats, const FluidOptions *opts) {
+    memset(stats, 0, sizeof(*stats));
+    stats->threshold = opts->stats_threshold;
+    stats->idle_energy = opts->idle_energy;
+    stats->idle_after = opts->idle_after < 0 ? (opts->headless ? 0 : IDLE_AFTER) : opts->idle_after;
+    // only the dirty renderer reads the boxes
+    stats->boxes = !opts->headless && stats->threshold <= DIRTY_THRESHOLD;
+    stats->count_every = opts->stats_every;
+}
+
+int stats_wanted(const FieldStats *stats, const FluidOptions *opts) {
+    return opts->stats_every > 0 || stats->idle_after > 0;
+}
+
+void print_stats(const FieldStats *stats) {
+    const BandStats *t = &stats->total;
+    printf("step %8llu  energy %12.6g  peak %10.6g  active %9lld",
+           (unsigned long long)stats->step, t->energy, t->peak, (long long)t->active);
+    if (t->active > 0) printf("  box %d,%d-%d,%d", t->x0, t->y0, t->x1, t->y1);
+    printf("\n");
+}
+
+// spread n oscillators evenly over the grid
+void place_oscillators(FluidGrid *fluid, int n) {
+    if (n <= 0) return;
+    int cols = (int)ceilf(sqrtf(n * (float)GRID_WIDTH / GRID_HEIGHT));
+    int rows = (n + cols - 1) / cols;
+
+    for (int i = 0; i < n; i++) {
+        int x = (i % cols + 1) * GRID_WIDTH / (cols + 1);
+        int y = (i / cols + 1) * GRID_HEIGHT / (rows + 1);
+        add_oscillator(fluid, x, y, 0.5f, 20.0f + (i % 7) * 5.0f);
+    }
+}
+
+// no window, just the solver and the workload, split into inject vs propagate time
+int run_headless(const FluidOptions *opts) {
+    FluidGrid fluid;
+    Storm storm;
+
+    CheckpointWriter writer = {0};
+    writer.compress = opts->checkpoint_compress;
+    SeriesWriter series = {0};
+    ProbeSet probes = {0};
+    ObstacleMask obstacles = {0};
+    SpeedMap speed = {0};
+    DampingMap damping_map = {0};
+    FieldStats stats = {0};
+    VideoExporter exporter = {0};
+    FluidRenderer frenderer = {0};
+    FluidShm shm = {0};
+    StreamServer server = {0};
+    int status = 1;
+
+    if (opts->backing_path) {
+        if (!init_fluid_mapped(&fluid, opts->backing_path)) return 1;
+    } else {
+        init_fluid(&fluid);
+    }
+    damping_from_options(&fluid, opts);
+    set_boundary(&fluid, opts->boundary, opts->sponge_width, opts->sponge_strength);
+    init_storm(&storm, &opts->storm);
+    place_oscillators(&fluid, opts->oscillators);
+    if (opts->restore_path && !load_checkpoint(&fluid, opts->restore_path)) goto done;
+
+    if (!open_series_from_options(&series, opts)) goto done;
+    if (!open_probes_from_options(&probes, opts)) goto done;
+    if (probes.count > 0) fluid.probes = &probes;
+    if (!open_obstacles_from_options(&obstacles, opts)) goto done;
+    if (obstacles.solid > 0) attach_obstacles(&fluid, &obstacles);
+    if (!open_speed_from_options(&speed, opts)) goto done;
+    if (speed.q) fluid.speed = &speed;
+    if (!open_damping_map_from_options(&damping_map, opts)) goto done;
+    if (damping_map.q) fluid.damping_map = &damping_map;
+    init_stats_from_options(&stats, opts);
+    if (stats_wanted(&stats, opts)) fluid.stats = &stats;
+
+    // colorized frames for export, same path as the window minus the texture
+    if (opts->export_path) {
+        frenderer.pixels = malloc(DISPLAY_CELLS * sizeof(uint32_t));
+        if (!frenderer.pixels || !open_exporter(&exporter, opts->export_path, opts->export_format,
+                                                opts->export_every, opts->export_fps)) goto done;
+    }
+
+    if (opts->shm_name && !open_shm(&shm, opts->shm_name)) goto done;
+    if (opts->serve_addr && !open_server(&server, opts->serve_addr, opts->serve_scale, opts->serve_error))
+        goto done;
+
+    Uint64 freq = SDL_GetPerformanceFrequency();
+    Uint64 inject_ticks = 0;
+    Uint64 update_ticks = 0;
+    Uint64 export_ticks = 0;
+    int idle_frames = 0;
+
+    for (int frame = 0; frame < opts->frames; frame++) {
+        Uint64 t0 = SDL_GetPerformanceCounter();
+        if (opts->storm_enabled) storm_step(&storm, &fluid);
+        Uint64 t1 = SDL_GetPerformanceCounter();
+        uint64_t before = fluid.step;
+        update_fluid(&fluid);
+        Uint64 t2 = SDL_GetPerformanceCounter();
+
+        inject_ticks += t1 - t0;
+        update_ticks += t2 - t1;
+        // a settled grid did not step, there is nothing new to hand out
+        if (fluid.step == before) {
+            idle_frames++;
+            continue;
+        }
+        if (opts->stats_every > 0 && fluid.step % opts->stats_every == 0) print_stats(&stats);
+
+        if (opts->checkpoint_every > 0 && fluid.step % opts->checkpoint_every == 0)
+            save_checkpoint_async(&writer, &fluid, opts->checkpoint_path);
+        series_push(&series, &fluid);
+        shm_publish(&shm, &fluid);
+        stream_publish(&server, &fluid);
+
+        if (opts->export_path && fluid.step % exporter.every == 0) {
+            Uint64 t3 = SDL_GetPerformanceCounter();
+            update_fluid_texture(&frenderer, &fluid, SDL_GetTicks());
+            export_push(&exporter, &frenderer, fluid.step);
+            export_ticks += SDL_GetPerformanceCounter() - t3;
+        }
+    }
+    status = 0;
+
+    // every exit past the grid goes through here, a failed start writes no probe file
+done:
+    checkpoint_wait(&writer);
+    close_series(&series);
+    close_exporter(&exporter);
+    close_shm(&shm);
+    close_server(&server);
+    free_fluid_renderer(&frenderer);
+    if (status == 0) close_probes(&probes, opts->probe_out);
+    else free_probes(&probes);
+    free_obstacles(&obstacles);
+    free_speed(&speed);
+    free_damping_map(&damping_map);
+    if (status != 0) {
+        free_fluid(&fluid);
+        return status;
+    }
+
+    // checksum so two runs with the same seed can be compared
+    double checksum = 0.0;
+    for (size_t i = 0; i < GRID_CELLS; i++) {
+        checksum += CELL_LOAD(fluid.current[i]);
+    }
+
+    int frames = opts->frames > 0 ? opts->frames : 1;
+    double inject_ms = 1000.0 * inject_ticks / freq;
+    double update_ms = 1000.0 * update_ticks / freq;
+    double total_ms = inject_ms + update_ms > 0.0 ? inject_ms + update_ms : 1.0;
+
+    printf("grid %dx%d %s, %d frames, seed %llu, step %llu\n", GRID_WIDTH, GRID_HEIGHT, CELL_NAME,
+           opts->frames, (unsigned long long)opts->storm.seed, (unsigned long long)fluid.step);
+    printf("drops %lu (%.1f/frame), boats %d, wave makers %d, emitters %d\n",
+           storm.drops, (double)storm.drops / frames, storm.config.boats, storm.config.wave_makers,
+           fluid.emitters.count);
+    printf("inject    %8.3f ms/frame (%4.1f%%)\n", inject_ms / frames, 100.0 * inject_ms / total_ms);
+    printf("propagate %8.3f ms/frame (%4.1f%%)\n", update_ms / frames, 100.0 * update_ms / total_ms);
+    if (idle_frames > 0) printf("idle      %d frames settled, not stepped\n", idle_frames);
+    if (opts->export_path) {
+        // colorize plus any wait for a free queue slot, outside the split above
+        printf("export    %8.3f ms/frame\n", 1000.0 * export_ticks / freq / frames);
+    }
+
+    // previous read, current read and written once per cell, neighbors come from cache
+    double cells = (double)(GRID_WIDTH - 2) * (GRID_HEIGHT - 2) * (frames - idle_frames);
+    double seconds = update_ticks > 0 ? (double)update_ticks / freq : 1e-9;
+    printf("          %8.1f Mcells/s, %.2f GB/s at %d bytes/cell, %.1f MB per grid\n",
+           cells / seconds * 1e-6, cells * 3 * sizeof(cell_t) / seconds * 1e-9,
+           (int)sizeof(cell_t), 2.0 * GRID_CELLS * sizeof(cell_t) / (1024.0 * 1024.0));
+    printf("checksum  %.9g\n", checksum);
+
+    free_fluid(&fluid);
+    return 0;
+}
+
+// plain leapfrogs, the references for --drift
+void reference_step(float *current, const float *previous, float damping) {
+    for (int y = 1; y < GRID_HEIGHT - 1; y++) {
+        for (int x = 1; x < GRID_WIDTH - 1; x++) {
+            size_t idx = (size_t)y * GRID_WIDTH + x;
+            float laplacian = previous[idx - 1] + previous[idx + 1] +
+                              previous[idx - GRID_WIDTH] + previous[idx + GRID_WIDTH] -
+                              4.0f * previous[idx];
+            current[idx] = (2.0f * previous[idx] - current[idx] + laplacian * 0.25f) * damping;
+        }
+    }
+}
+
+void reference_step_f64(double *current, const double *previous, double damping) {
+    for (int y = 1; y < GRID_HEIGHT - 1; y++) {
+        for (int x = 1; x < GRID_WIDTH - 1; x++) {
+            size_t idx = (size_t)y * GRID_WIDTH + x;
+            double laplacian = previous[idx - 1] + previous[idx + 1] +
+                               previous[idx - GRID_WIDTH] + previous[idx + GRID_WIDTH] -
+                               4.0 * previous[idx];
+            current[idx] = (2.0 * previous[idx] - current[idx] + laplacian * 0.25) * damping;
+        }
+    }
+}
+
+// full value of a cell including the kahan residue
+static inline double cell_value(const FluidGrid *fluid, size_t idx) {
+#if FLUID_STORAGE == FLUID_KAHAN
+    return (double)fluid->current[idx] + fluid->current_lo[idx];
+#else
+    return CELL_LOAD(fluid->current[idx]);
+#endif
+}
+
+// runs the compiled storage next to float32 and float64 references fed the same injections
+int run_drift(const FluidOptions *opts) {
+    FluidGrid fluid;
+    Storm storm;
+    size_t cells = GRID_CELLS;
+
+    init_fluid(&fluid);
+    fluid.damping = opts->damping;
+    init_storm(&storm, &opts->storm);
+
+    float *ref_current = calloc(cells, sizeof(float));
+    float *ref_previous = calloc(cells, sizeof(float));
+    double *ref64_current = calloc(cells, sizeof(double));
+    double *ref64_previous = calloc(cells, sizeof(double));
+    cell_t *before = malloc(cells * sizeof(cell_t));
+    if (!ref_current || !ref_previous || !ref64_current || !ref64_previous || !before) {
+        printf("Failed to allocate reference grid\n");
+        return 1;
+    }
+
+    // without a storm, seed one drop so there is something to drift
+    if (!opts->storm_enabled) {
+        add_water_drop(&fluid, GRID_WIDTH / 2, GRID_HEIGHT / 2, 20.0f);
+        for (size_t i = 0; i < cells; i++) {
+            ref_previous[i] = CELL_LOAD(fluid.previous[i]);
+            ref64_previous[i] = CELL_LOAD(fluid.previous[i]);
+        }
+    }
+    if (opts->oscillators > 0) {
+        printf("note: --drift ignores --oscillators\n");
+    }
+#if FLUID_STENCIL == STENCIL_13
+    printf("note: the references use the 5 point stencil, drift includes the difference\n");
+#endif
+
+    int report = opts->drift_steps >= 10 ? opts->drift_steps / 10 : 1;
+    printf("drift of %s vs float32 and float64 references, damping %g\n", CELL_NAME, opts->damping);
+    printf("%10s %14s %14s %14s %14s\n", "step", "rms vs f32", "max vs f32", "rms vs f64", "energy ratio");
+
+    for (int step = 1; step <= opts->drift_steps; step++) {
+        if (opts->storm_enabled) {
+            // hand the references exactly what the storm put into the test grid
+            memcpy(before, fluid.previous, cells * sizeof(cell_t));
+            storm_step(&storm, &fluid);
+            for (size_t i = 0; i < cells; i++) {
+                if (fluid.previous[i] != before[i]) {
+                    double delta = (double)CELL_LOAD(fluid.previous[i]) - CELL_LOAD(before[i]);
+                    ref_previous[i] += (float)delta;
+                    ref64_previous[i] += delta;
+                }
+            }
+        }
+
+        update_fluid(&fluid);
+        reference_step(ref_current, ref_previous, opts->damping);
+        reference_step_f64(ref64_current, ref64_previous, opts->damping);
+        float *temp = ref_current;
+        ref_current = ref_previous;
+        ref_previous = temp;
+        double *temp64 = ref64_current;
+        ref64_current = ref64_previous;
+        ref64_previous = temp64;
+
+        if (step % report == 0 || step == opts->drift_steps) {
+            double err2 = 0.0, max_err = 0.0, err64 = 0.0, e_test = 0.0, e_ref = 0.0;
+            for (size_t i = 0; i < cells; i++) {
+                double t = cell_value(&fluid, i);
+                double d = fabs(t - ref_current[i]);
+                double d64 = t - ref64_current[i];
+                err2 += d * d;
+                if (d > max_err) max_err = d;
+                err64 += d64 * d64;
+                e_test += t * t;
+                e_ref += ref64_current[i] * ref64_current[i];
+            }
+            printf("%10d %14.6g %14.6g %14.6g %14.6f\n", step, sqrt(err2 / cells), max_err,
+                   sqrt(err64 / cells), e_ref > 0.0 ? e_test / e_ref : 1.0);
+        }
+    }
+
+    free(ref_current);
+    free(ref_previous);
+    free(ref64_current);
+    free(ref64_previous);
+    free(before);
+    free_fluid(&fluid);
+    return 0;
+}
+
+// phase speed of a plane wave on the grid over the exact one, with ppw cells per
+// wavelength at angle theta off the x axis. symbol is what wave_term adds per
+// unit of height, and the leapfrog turns it into 2 cos(omega) - 2 = symbol
+static double stencil_phase_ratio(int stencil, double k, double ppw, double theta) {
+    double w = 6.283185307179586 / ppw;
+    double cx = cos(w * cos(theta)), cy = cos(w * sin(theta));
+    double near = 2 * cx + 2 * cy;
+    double symbol = k * (near - 4);
+    if (stencil == STENCIL_13) {
+        double far = 2 * cos(2 * w * cos(theta)) + 2 * cos(2 * w * sin(theta));
+        double corners = 4 * cx * cy;
+        symbol = k / 12 * (16 * near - far - 60 + k * (far - 8 * near + 2 * corners + 20));
+    }
+    return acos(1 + symbol / 2) / (sqrt(k) * w);
+}
+
+// worst phase speed error over angles, both stencils are symmetric about 45 degrees
+static double stencil_phase_error(int stencil, double k, double ppw) {
+    double worst = 0.0;
+    for (int a = 0; a <= 45; a += 5) {
+        double e = fabs(stencil_phase_ratio(stencil, k, ppw, a * 0.017453292519943295) - 1.0);
+        if (e > worst) worst = e;
+    }
+    return worst;
+}
+
+// fewest cells per wavelength that keep the phase error under err
+static double stencil_resolution(int stencil, double k, double err) {
+    double ppw = 2.5;
+    while (ppw < 1000.0 && stencil_phase_error(stencil, k, ppw) > err) ppw *= 1.01;
+    return ppw;
+}
+
+// dispersion of both stencils from their symbols, then the compiled one timed.
+// for a fixed domain and number of wave periods the work goes with ppw^2 cells
+// times ppw steps per period, so at equal error the wide stencil wins as long
+// as its cost per cell step is under (ppw 5 / ppw 13)^3 times the cross's
+int run_stencil_bench(const FluidOptions *opts) {
+    const double k = 0.25;
+    const int stencils[2] = { STENCIL_5, STENCIL_13 };
+
+    printf("phase speed error at k %.2f, along the axis / along the diagonal\n", k);
+    printf("%6s %25s %25s\n", "ppw", "5 point", "13 point");
+    for (int ppw = 4; ppw <= 32; ppw *= 2) {
+        printf("%6d", ppw);
+        for (int s = 0; s < 2; s++) {
+            printf("     %7.4f%% / %7.4f%%",
+                   100.0 * (stencil_phase_ratio(stencils[s], k, ppw, 0.0) - 1.0),
+                   100.0 * (stencil_phase_ratio(stencils[s], k, ppw, 0.7853981633974483) - 1.0));
+        }
+        printf("\n");
+    }
+
+    printf("\n%10s %12s %12s %18s\n", "max error", "ppw 5", "ppw 13", "break even cost");
+    const double errors[3] = { 1e-2, 1e-3, 1e-4 };
+    for (int e = 0; e < 3; e++) {
+        double p5 = stencil_resolution(STENCIL_5, k, errors[e]);
+        double p13 = stencil_resolution(STENCIL_13, k, errors[e]);
+        printf("%9g%% %12.1f %12.1f %17.1fx\n", 100.0 * errors[e], p5, p13, pow(p5 / p13, 3.0));
+    }
+
+    FluidGrid fluid;
+    Storm storm;
+    init_fluid(&fluid);
+    fluid.damping = opts->damping;
+    init_storm(&storm, &opts->storm);
+    if (!opts->storm_enabled) add_water_drop(&fluid, GRID_WIDTH / 2, GRID_HEIGHT / 2, 20.0f);
+
+    Uint64 freq = SDL_GetPerformanceFrequency();
+    Uint64 ticks = 0;
+    for (int step = 0; step < opts->stencil_bench; step++) {
+        if (opts->storm_enabled) storm_step(&storm, &fluid);
+        Uint64 t0 = SDL_GetPerformanceCounter();
+        update_fluid(&fluid);
+        ticks += SDL_GetPerformanceCounter() - t0;
+    }
+
+    double cells = (double)(GRID_WIDTH - 2) * (GRID_HEIGHT - 2) * opts->stencil_bench;
+    double ns = ticks > 0 ? 1e9 * ticks / freq / cells : 0.0;
+    printf("\ncompiled %d point %s: %.3f ns per cell step over %d steps of %dx%d\n",
+           FLUID_STENCIL, CELL_NAME, ns, opts->stencil_bench, GRID_WIDTH, GRID_HEIGHT);
+    for (int e = 0; e < 3; e++) {
+        double ppw = stencil_resolution(FLUID_STENCIL, k, errors[e]);
+        // a wave period is ppw / sqrt(k) steps
+        printf("at %g%%: %.3g us per square wavelength and wave period\n", 100.0 * errors[e],
+               ns * ppw * ppw * ppw / sqrt(k) * 1e-3);
+    }
+
+    free_fluid(&fluid);
+    return 0;
+}
+
+// batch of same sized grids interleaved lane by lane: cell (x, y) of member k is at
+// ((y * width + x) * BATCH_LANES + k), so one vector holds that cell for every member
+// and the stencil needs no edge handling per grid
+#ifndef BATCH_LANES
+#ifdef __AVX512F__
+#define BATCH_LANES 16
+#else
+#define BATCH_LANES 8
+#endif
+#endif
+
+// one cell of every member; gcc splits it into whatever vector width the target has
+typedef float batch_vec __attribute__((vector_size(BATCH_LANES * sizeof(float))));
+
+typedef struct {
+    int width;
+    int height;
+    int lanes;                  // members in use, <= BATCH_LANES
+    float *current;
+    float *previous;
+    float damping[BATCH_LANES]; // per member, unused lanes stay 0
+} GridBatch;
+
+int init_grid_batch(GridBatch *b, int width, int height, int lanes) {
+    memset(b, 0, sizeof(*b));
+    size_t bytes = (size_t)width * height * sizeof(batch_vec);
+    b->current = aligned_alloc(sizeof(batch_vec), bytes);
+    b->previous = aligned_alloc(sizeof(batch_vec), bytes);
+    if (!b->current || !b->previous) {
+        free(b->current);
+        free(b->previous);
+        return 0;
+    }
+    memset(b->current, 0, bytes);
+    memset(b->previous, 0, bytes);
+    b->width = width;
+    b->height = height;
+    b->lanes = lanes < BATCH_LANES ? lanes : BATCH_LANES;
+    return 1;
+}
+
+void free_grid_batch(GridBatch *b) {
+    free(b->current);
+    free(b->previous);
+    memset(b, 0, sizeof(*b));
+}
+
+// member lane's previous field as a strided grid, what injections write into
+static inline float *batch_member(GridBatch *b, int lane) {
+    return b->previous + lane;
+}
+
+void batch_inject(GridBatch *b, int lane, int x, int y, float amount) {
+    if (lane < 0 || lane >= b->lanes || x < 1 || x >= b->width - 1 || y < 1 || y >= b->height - 1) return;
+    b->previous[((size_t)y * b->width + x) * BATCH_LANES + lane] += amount;
+}
+
+// copies one member's current heights out into a plain width x height array
+void batch_extract(const GridBatch *b, int lane, float *dst) {
+    size_t cells = (size_t)b->width * b->height;
+    for (size_t i = 0; i < cells; i++) dst[i] = b->previous[i * BATCH_LANES + lane];
+}
+
+// one step for every member; energy[k] gets member k's new sum of squares.
+// after the swap the newest field is in previous, like update_fluid's buffers
+void batch_step(GridBatch *b, double *energy) {
+    const int w = b->width;
+    const batch_vec *prev = (const batch_vec *)b->previous;
+    batch_vec *cur = (batch_vec *)b->current;
+    batch_vec damping;
+    memcpy(&damping, b->damping, sizeof(damping));
+    for (int k = 0; k < BATCH_LANES; k++) energy[k] = 0.0;
+
+    for (int y = 1; y < b->height - 1; y++) {
+        batch_vec row_energy = {0};
+        for (int x = 1; x < w - 1; x++) {
+            size_t i = (size_t)y * w + x;
+            batch_vec p = prev[i];
+            batch_vec laplacian = prev[i - 1] + prev[i + 1] + prev[i - w] + prev[i + w] - 4.0f * p;
+            batch_vec v = (2.0f * p - cur[i] + laplacian * 0.25f) * damping;
+            cur[i] = v;
+            row_energy += v * v;
+        }
+        for (int k = 0; k < BATCH_LANES; k++) energy[k] += row_energy[k];
+    }
+
+    float *temp = b->current;
+    b->current = b->previous;
+    b->previous = temp;
+}
+
+// ensemble sweeps: many small grids in one process. members have their own size,
+// so they use runtime sized buffers instead of FluidGrid. same sized members are
+// stepped together in a GridBatch, batches are handed out dynamically to the
+// openmp threads, largest first
+#define ENSEMBLE_BATCH BATCH_LANES
+#define ENSEMBLE_MAX_SIZES 16
+
+typedef enum {
+    PATTERN_DROP,
+    PATTERN_RING,
+    PATTERN_LINE,
+    PATTERN_RAIN,
+    PATTERN_COUNT
+} EnsemblePattern;
+
+static const char *pattern_names[PATTERN_COUNT] = { "drop", "ring", "line", "rain" };
+
+typedef struct {
+    int id;
+    int width;
+    int height;
+    float damping;
+    int pattern;
+    uint64_t seed;
+    // results
+    double energy_peak;         // sum of squared heights
+    double energy_end;
+    double peak;
+    double rms;
+    double checksum;            // sum of the final heights
+    int half_life;              // steps from the energy peak to half of it, -1 if never
+    double ms;
+} EnsembleMember;
+
+// one leapfrog step of a w x h grid, returns the new sum of squares
+static double small_grid_step(float *current, const float *previous, int w, int h, float damping) {
+    double energy = 0.0;
+    for (int y = 1; y < h - 1; y++) {
+        float *c = current + (size_t)y * w;
+        const float *p = previous + (size_t)y * w;
+        float row = 0.0f;
+        for (int x = 1; x < w - 1; x++) {
+            float laplacian = p[x - 1] + p[x + 1] + p[x - w] + p[x + w] - 4.0f * p[x];
+            c[x] = (2.0f * p[x] - c[x] + laplacian * 0.25f) * damping;
+            row += c[x] * c[x];
+        }
+        energy += row;
+    }
+    return energy;
+}
+
+// same shape as add_water_drop. grids are strided so a batch lane works too
+static void small_grid_drop(float *grid, size_t stride, int w, int h, int x, int y, float intensity) {
+    for (int dy = -3; dy <= 3; dy++) {
+        for (int dx = -3; dx <= 3; dx++) {
+            int cx = x + dx, cy = y + dy;
+            float dist = sqrtf(dx * dx + dy * dy);
+            if (dist > 3.0f || cx < 1 || cx >= w - 1 || cy < 1 || cy >= h - 1) continue;
+            grid[((size_t)cy * w + cx) * stride] += intensity * cosf(dist * 1.5f) * expf(-dist * dist * 0.3f);
+        }
+    }
+}
+
+static void member_inject(const EnsembleMember *m, float *grid, size_t stride, Storm *rng, int step) {
+    int w = m->width, h = m->height;
+    switch (m->pattern) {
+    case PATTERN_DROP:
+        if (step == 0)
+            small_grid_drop(grid, stride, w, h, 4 + (int)(storm_uniform(rng) * (w - 8)),
+                            4 + (int)(storm_uniform(rng) * (h - 8)), 20.0f);
+        break;
+    case PATTERN_RING:
+        if (step == 0) {
+            float r = fminf(w, h) * 0.25f;
+            for (int y = 1; y < h - 1; y++) {
+                for (int x = 1; x < w - 1; x++) {
+                    float d = hypotf(x - w * 0.5f, y - h * 0.5f) - r;
+                    grid[((size_t)y * w + x) * stride] += 10.0f * expf(-d * d * 0.5f);
+                }
+            }
+        }
+        break;
+    case PATTERN_LINE:
+        if (step == 0) {
+            int x = 2 + (int)(storm_uniform(rng) * (w - 4));
+            for (int y = 1; y < h - 1; y++) grid[((size_t)y * w + x) * stride] += 10.0f;
+        }
+        break;
+    case PATTERN_RAIN: {
+        // about one drop per 4096 cells per step, like --rain on the main grid
+        int drops = storm_poisson(rng, w * h / 4096.0f);
+        for (int i = 0; i < drops; i++)
+            small_grid_drop(grid, stride, w, h, 4 + (int)(storm_uniform(rng) * (w - 8)),
+                            4 + (int)(storm_uniform(rng) * (h - 8)), 20.0f);
+        break;
+    }
+    }
+}
+
+// the injection stream depends on seed, pattern and size only, so members that
+// differ in damping alone get the same drops and a sweep compares like with like
+static void member_seed(const EnsembleMember *m, Storm *rng) {
+    memset(rng, 0, sizeof(*rng));
+    uint64_t h = (m->seed + 1) * 0x9E3779B97F4A7C15ULL;
+    h ^= (uint64_t)m->pattern << 56 ^ (uint64_t)(uint32_t)m->width << 28 ^ (uint32_t)m->height;
+    h = (h ^ h >> 30) * 0xBF58476D1CE4E5B9ULL;
+    h = (h ^ h >> 27) * 0x94D049BB133111EBULL;
+    rng->rng = (h ^ h >> 31) | 1;   // zero state would lock xorshift
+}
 
-void init_fluid(FluidGrid *fluid) {
-    fluid->current = calloc(GRID_WIDTH * GRID_HEIGHT, sizeof(float));
-    fluid->previous = calloc(GRID_WIDTH * GRID_HEIGHT, sizeof(float));
-    fluid->damping = 0.99f;
+static void member_track(EnsembleMember *m, double energy, int step, int *peak_step) {
+    if (energy > m->energy_peak) {
+        m->energy_peak = energy;
+        *peak_step = step;
+        m->half_life = -1;
+    } else if (m->half_life < 0 && energy <= 0.5 * m->energy_peak) {
+        m->half_life = step - *peak_step;
+    }
+    m->energy_end = energy;
 }
 
-void free_fluid(FluidGrid *fluid) {
-    free(fluid->current);
-    free(fluid->previous);
+static void member_finish(EnsembleMember *m, const float *field, double ms) {
+    size_t cells = (size_t)m->width * m->height;
+    m->peak = 0.0;
+    m->checksum = 0.0;
+    for (size_t i = 0; i < cells; i++) {
+        m->peak = fmax(m->peak, fabsf(field[i]));
+        m->checksum += field[i];
+    }
+    m->rms = sqrt(m->energy_end / cells);
+    m->ms = ms;
 }
 
-int init_fluid_renderer(SDL_Renderer *renderer, FluidRenderer *frenderer) {
-    // Create texture for fluid rendering
-    frenderer->texture = SDL_CreateTexture(renderer, 
-        SDL_PIXELFORMAT_ARGB8888, 
-        SDL_TEXTUREACCESS_STREAMING, 
-        GRID_WIDTH, GRID_HEIGHT);
-    
-    if (!frenderer->texture) {
-        printf("Failed to create texture: %s\n", SDL_GetError());
-        return 0;
+// one member on its own buffers, the --ensemble-layout single path
+static void run_member(EnsembleMember *m, int steps) {
+    size_t cells = (size_t)m->width * m->height;
+    float *current = calloc(cells, sizeof(float));
+    float *previous = calloc(cells, sizeof(float));
+    if (!current || !previous) {
+        free(current);
+        free(previous);
+        m->half_life = -2;
+        return;
     }
-    
-    frenderer->pixels = malloc(GRID_WIDTH * GRID_HEIGHT * sizeof(uint32_t));
-    if (!frenderer->pixels) {
-        printf("Failed to allocate pixel buffer\n");
-        return 0;
+
+    Storm rng;
+    member_seed(m, &rng);
+    Uint64 t0 = SDL_GetPerformanceCounter();
+
+    int peak_step = 0;
+    m->half_life = -1;
+    for (int step = 0; step < steps; step++) {
+        member_inject(m, previous, 1, &rng, step);
+        double energy = small_grid_step(current, previous, m->width, m->height, m->damping);
+        float *temp = current;
+        current = previous;
+        previous = temp;
+        member_track(m, energy, step, &peak_step);
     }
-    
-    frenderer->pitch = GRID_WIDTH * sizeof(uint32_t);
-    return 1;
+
+    member_finish(m, previous, 1000.0 * (SDL_GetPerformanceCounter() - t0) / SDL_GetPerformanceFrequency());
+    free(current);
+    free(previous);
 }
 
-void free_fluid_renderer(FluidRenderer *frenderer) {
-    if (frenderer->texture) SDL_DestroyTexture(frenderer->texture);
-    if (frenderer->pixels) free(frenderer->pixels);
+// up to BATCH_LANES same sized members stepped together, one lane each
+static void run_batch(EnsembleMember *members, int n, int steps) {
+    GridBatch batch;
+    if (!init_grid_batch(&batch, members[0].width, members[0].height, n)) {
+        for (int k = 0; k < n; k++) members[k].half_life = -2;
+        return;
+    }
+
+    Storm rng[BATCH_LANES];
+    int peak_step[BATCH_LANES] = {0};
+    for (int k = 0; k < batch.lanes; k++) {
+        member_seed(&members[k], &rng[k]);
+        batch.damping[k] = members[k].damping;
+        members[k].half_life = -1;
+    }
+    Uint64 t0 = SDL_GetPerformanceCounter();
+
+    double energy[BATCH_LANES];
+    for (int step = 0; step < steps; step++) {
+        for (int k = 0; k < batch.lanes; k++)
+            member_inject(&members[k], batch_member(&batch, k), BATCH_LANES, &rng[k], step);
+        batch_step(&batch, energy);
+        for (int k = 0; k < batch.lanes; k++) member_track(&members[k], energy[k], step, &peak_step[k]);
+    }
+
+    // the batch's time is shared evenly between its members
+    double ms = 1000.0 * (SDL_GetPerformanceCounter() - t0) / SDL_GetPerformanceFrequency() / batch.lanes;
+    float *field = malloc((size_t)batch.width * batch.height * sizeof(float));
+    for (int k = 0; k < batch.lanes && field; k++) {
+        batch_extract(&batch, k, field);
+        member_finish(&members[k], field, ms);
+    }
+    free(field);
+    free_grid_batch(&batch);
 }
 
-// simd memory
-void update_fluid(FluidGrid *fluid) {
-    // inside grid
-    for (int y = 1; y < GRID_HEIGHT - 1; y++) {
-        int row_start = y * GRID_WIDTH;
-        
-        for (int x = 1; x < GRID_WIDTH - 1; x++) {
-            int idx = row_start + x;
-            
-            // wave
-            float laplacian = 
-                fluid->previous[idx - 1] +
-                fluid->previous[idx + 1] +
-                fluid->previous[idx - GRID_WIDTH] +
-                fluid->previous[idx + GRID_WIDTH] -
-                4.0f * fluid->previous[idx];
-            
-            // up damp
-            fluid->current[idx] = 
-                (2.0f * fluid->previous[idx] - fluid->current[idx] + laplacian * 0.25f) 
-                * fluid->damping;
+// largest grids first so the long tasks start early
+static int compare_member_area(const void *a, const void *b) {
+    const EnsembleMember *x = a, *y = b;
+    int64_t ax = (int64_t)x->width * x->height, ay = (int64_t)y->width * y->height;
+    if (ax != ay) return ax < ay ? 1 : -1;
+    return x->id - y->id;
+}
+
+static int compare_member_id(const void *a, const void *b) {
+    return ((const EnsembleMember *)a)->id - ((const EnsembleMember *)b)->id;
+}
+
+// "64,128x96" into sizes, returns how many
+static int parse_sizes(const char *list, int *widths, int *heights) {
+    int n = 0;
+    const char *p = list;
+    while (*p && n < ENSEMBLE_MAX_SIZES) {
+        char *end;
+        int w = (int)strtol(p, &end, 10);
+        int h = w;
+        if (*end == 'x') h = (int)strtol(end + 1, &end, 10);
+        if (w >= 8 && h >= 8) {
+            widths[n] = w;
+            heights[n] = h;
+            n++;
         }
+        p = *end == ',' ? end + 1 : end;
+        if (*end && *end != ',') break;
     }
-    
-    // buffers 
-    float *temp = fluid->current;
-    fluid->current = fluid->previous;
-    fluid->previous = temp;
+    return n;
 }
 
-void add_disturbance(FluidGrid *fluid, int x, int y, float intensity) {
-    if (x >= 1 && x < GRID_WIDTH - 1 && y >= 1 && y < GRID_HEIGHT - 1) {
-        int idx = y * GRID_WIDTH + x;
-        fluid->previous[idx] += intensity;
+// --ensemble-layout check: reruns every member on its own buffers and compares the
+// final field's checksum with its interleaved run, then compares members that only
+// differ in id. seeds ignore the id and the layout, so all of them have to agree to
+// the last bit. the energy sums may not, fma contraction rounds them differently
+static int check_layouts(const EnsembleMember *members, int count, int steps) {
+    EnsembleMember *alone = malloc(count * sizeof(EnsembleMember));
+    if (!alone) {
+        printf("Failed to allocate the layout check\n");
+        return 1;
     }
-}
+    memcpy(alone, members, count * sizeof(EnsembleMember));
 
-void add_continuous_wave(FluidGrid *fluid, int x1, int y1, int x2, int y2, float intensity) {
-    // 2 poitns
-    float dx = x2 - x1;
-    float dy = y2 - y1;
-    float distance = sqrtf(dx*dx + dy*dy);
-    
-    if (distance < 1.0f) {
-        add_disturbance(fluid, x1, y1, intensity);
-        return;
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (int i = 0; i < count; i++) run_member(&alone[i], steps);
+
+    int layouts = 0, twins = 0, pairs = 0;
+    for (int i = 0; i < count; i++) {
+        const EnsembleMember *m = &members[i];
+        if (m->checksum != alone[i].checksum) {
+            if (layouts++ < 8)
+                printf("member %d: checksum %.17g interleaved, %.17g alone\n", m->id, m->checksum,
+                       alone[i].checksum);
+        }
+        for (int j = i + 1; j < count; j++) {
+            const EnsembleMember *o = &members[j];
+            if (o->width != m->width || o->height != m->height || o->pattern != m->pattern ||
+                o->seed != m->seed || o->damping != m->damping)
+                continue;
+            pairs++;
+            if (o->checksum != m->checksum || alone[j].checksum != alone[i].checksum) {
+                if (twins++ < 8) printf("members %d and %d are identical but differ\n", m->id, o->id);
+            }
+        }
     }
-    
-    //pre calculation 
-    int steps = (int)(distance * 1.5f) + 1;
-    float inv_steps = 1.0f / steps;
-    
-    for (int i = 0; i <= steps; i++) {
-        float t = i * inv_steps;
-        int cx = (int)(x1 + dx * t);
-        int cy = (int)(y1 + dy * t);
-        float current_intensity = intensity * (1.0f - t * 0.3f);
-        
-        // smaller radius
-        if (cx >= 2 && cx < GRID_WIDTH - 2 && cy >= 2 && cy < GRID_HEIGHT - 2) {
-            add_disturbance(fluid, cx, cy, current_intensity);
+    printf("layout check: %d of %d members differ between layouts, %d of %d identical pairs differ\n",
+           layouts, count, twins, pairs);
+    free(alone);
+    return layouts + twins;
+}
+
+// "drop,rain" into patterns, exact names each once. returns how many, -1 for an unknown name
+static int parse_patterns(const char *list, int *patterns) {
+    int n = 0;
+    const char *p = list;
+    while (*p) {
+        size_t len = strcspn(p, ",");
+        if (len > 0) {
+            int found = -1;
+            for (int k = 0; k < PATTERN_COUNT; k++)
+                if (strlen(pattern_names[k]) == len && strncmp(p, pattern_names[k], len) == 0) found = k;
+            if (found < 0) {
+                printf("unknown pattern \"%.*s\"\n", (int)len, p);
+                return -1;
+            }
+            int seen = 0;
+            for (int k = 0; k < n; k++) seen |= patterns[k] == found;
+            if (!seen) patterns[n++] = found;
         }
+        p += len;
+        if (*p == ',') p++;
     }
+    return n;
 }
 
-// realestic distrubince
-void add_water_drop(FluidGrid *fluid, int x, int y, float intensity) {
-    if (x >= 3 && x < GRID_WIDTH - 3 && y >= 3 && y < GRID_HEIGHT - 3) {
-        // Create a realistic water drop pattern
-        for (int dy = -3; dy <= 3; dy++) {
-            for (int dx = -3; dx <= 3; dx++) {
-                float dist = sqrtf(dx*dx + dy*dy);
-                if (dist <= 3.0f) {
-                    // gaus distrurbiacne 
-                    float falloff = expf(-dist * dist * 0.3f);
-                    float wave = cosf(dist * 1.5f) * falloff;
-                    add_disturbance(fluid, x + dx, y + dy, intensity * wave);
+// every combination of damping, size, pattern and seed, one line each in the csv
+int run_ensemble(const FluidOptions *opts) {
+    int widths[ENSEMBLE_MAX_SIZES], heights[ENSEMBLE_MAX_SIZES];
+    int sizes = parse_sizes(opts->sweep_sizes, widths, heights);
+    int patterns[PATTERN_COUNT];
+    int npatterns = parse_patterns(opts->sweep_patterns, patterns);
+    if (npatterns < 0) return 1;
+    int dampings = opts->sweep_damping_count > 0 ? opts->sweep_damping_count : 1;
+    int seeds = opts->sweep_seeds > 0 ? opts->sweep_seeds : 1;
+    if (sizes == 0 || npatterns == 0) {
+        printf("empty sweep: sizes \"%s\", patterns \"%s\"\n", opts->sweep_sizes, opts->sweep_patterns);
+        return 1;
+    }
+
+    int count = dampings * sizes * npatterns * seeds;
+    EnsembleMember *members = calloc(count, sizeof(EnsembleMember));
+    if (!members) {
+        printf("Failed to allocate %d ensemble members\n", count);
+        return 1;
+    }
+    int id = 0;
+    for (int d = 0; d < dampings; d++) {
+        float t = dampings > 1 ? (float)d / (dampings - 1) : 0.0f;
+        float damping = opts->sweep_damping_lo + t * (opts->sweep_damping_hi - opts->sweep_damping_lo);
+        for (int s = 0; s < sizes; s++) {
+            for (int p = 0; p < npatterns; p++) {
+                for (int k = 0; k < seeds; k++) {
+                    EnsembleMember *m = &members[id];
+                    m->id = id++;
+                    m->width = widths[s];
+                    m->height = heights[s];
+                    m->damping = damping;
+                    m->pattern = patterns[p];
+                    m->seed = opts->storm.seed + k;
                 }
             }
         }
     }
+
+    // batches never mix sizes, so a batch is uniform work
+    qsort(members, count, sizeof(EnsembleMember), compare_member_area);
+    int *batch_start = malloc((count + 1) * sizeof(int));
+    if (!batch_start) {
+        printf("Failed to allocate %d ensemble batches\n", count);
+        free(members);
+        return 1;
+    }
+    int batches = 0;
+    for (int i = 0; i < count; i++) {
+        if (i == 0 || i - batch_start[batches - 1] == ENSEMBLE_BATCH ||
+            members[i].width != members[i - 1].width || members[i].height != members[i - 1].height)
+            batch_start[batches++] = i;
+    }
+    batch_start[batches] = count;
+
+    int steps = opts->ensemble_steps;
+    Uint64 t0 = SDL_GetPerformanceCounter();
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (int b = 0; b < batches; b++) {
+        if (opts->ensemble_layout == LAYOUT_SINGLE) {
+            for (int i = batch_start[b]; i < batch_start[b + 1]; i++) run_member(&members[i], steps);
+        } else {
+            run_batch(&members[batch_start[b]], batch_start[b + 1] - batch_start[b], steps);
+        }
+    }
+    double seconds = (double)(SDL_GetPerformanceCounter() - t0) / SDL_GetPerformanceFrequency();
+    qsort(members, count, sizeof(EnsembleMember), compare_member_id);
+    int mismatches = opts->ensemble_layout == LAYOUT_CHECK ? check_layouts(members, count, steps) : 0;
+
+    FILE *f = fopen(opts->ensemble_out, "w");
+    if (!f) {
+        printf("Failed to open %s\n", opts->ensemble_out);
+        free(members);
+        free(batch_start);
+        return 1;
+    }
+    fprintf(f, "id,width,height,damping,pattern,seed,steps,energy_peak,energy_end,peak,rms,checksum,half_life,ms\n");
+    double cell_steps = 0.0;
+    for (int i = 0; i < count; i++) {
+        const EnsembleMember *m = &members[i];
+        fprintf(f, "%d,%d,%d,%.6g,%s,%llu,%d,%.9g,%.9g,%.9g,%.9g,%.17g,%d,%.3f\n", m->id, m->width, m->height,
+                m->damping, pattern_names[m->pattern], (unsigned long long)m->seed, steps,
+                m->energy_peak, m->energy_end, m->peak, m->rms, m->checksum, m->half_life, m->ms);
+        cell_steps += (double)(m->width - 2) * (m->height - 2) * steps;
+    }
+    fclose(f);
+
+    const char *layout = opts->ensemble_layout == LAYOUT_SINGLE ? "one at a time" : "interleaved";
+    printf("ensemble: %d members in %d batches of up to %d (%s), %d steps each, %.2f s, %.1f Mcells/s -> %s\n",
+           count, batches, ENSEMBLE_BATCH, layout, steps, seconds,
+           cell_steps / (seconds > 0.0 ? seconds : 1e-9) * 1e-6, opts->ensemble_out);
+    free(members);
+    free(batch_start);
+    return mismatches > 0;
 }
 
-// water color 
-uint32_t water_color(float height, float x, float y, Uint32 time) {
-    //color
-    float base_r = 0.1f;
-    float base_g = 0.2f;
-    float base_b = 0.4f;
-    
-    // wave effect
-    float wave_intensity = fabsf(height) * 2.0f;
-    
-    // foam
-    float foam = fmaxf(0.0f, height - 0.3f) * 3.0f;
-    foam = fminf(foam, 1.0f);
-    
-    // refelction
-    float light = fmaxf(0.0f, height) * 1.5f;
-    light = fminf(light, 0.8f);
-    
-    // combine w,f,r
-    float r = base_r + foam + light * 0.3f;
-    float g = base_g + foam * 0.8f + light * 0.4f;
-    float b = base_b + foam + light * 0.2f;
-    
-    r = fminf(fmaxf(r, 0.0f), 1.0f);
-    g = fminf(fmaxf(g, 0.0f), 1.0f);
-    b = fminf(fmaxf(b, 0.0f), 1.0f);
-    
-    return ((uint32_t)(r * 255) << 16) | 
-           ((uint32_t)(g * 255) << 8) | 
-           ((uint32_t)(b * 255)) | 
-           0xFF000000;
+typedef struct {
+    const char *name;
+    float error_bound;          // < 0 for the 8 bit zrle path the series writer uses
+    float *enc_recon;
+    float *dec_recon;
+    double bytes;
+    Uint64 enc_ticks;
+    Uint64 dec_ticks;
+    double max_err;
+} CodecRun;
+
+// feeds every storm frame through each codec, key frame every series chunk,
+// checks the round trip and reports ratio and throughput against raw float32
+int run_codec_bench(const FluidOptions *opts) {
+    FluidGrid fluid;
+    Storm storm;
+    size_t cells = GRID_CELLS;
+
+    init_fluid(&fluid);
+    fluid.damping = opts->damping;
+    init_storm(&storm, &opts->storm);
+    place_oscillators(&fluid, opts->oscillators);
+    if (!opts->storm_enabled) add_water_drop(&fluid, GRID_WIDTH / 2, GRID_HEIGHT / 2, 20.0f);
+
+    CodecRun runs[] = {
+        { .name = "zrle 8 bit", .error_bound = -1.0f },
+        { .name = "delta lossless", .error_bound = 0.0f },
+        { .name = "delta 1e-4", .error_bound = 1e-4f },
+        { .name = "delta 1e-3", .error_bound = 1e-3f },
+        { .name = "delta 1e-2", .error_bound = 1e-2f },
+    };
+    int nruns = sizeof(runs) / sizeof(runs[0]);
+    int key_every = opts->series_chunk > 0 ? opts->series_chunk : 16;
+
+    SeriesHeader q8 = { .width = GRID_WIDTH, .height = GRID_HEIGHT, .quant_bits = 8 };
+    float *field = malloc(cells * sizeof(float));
+    uint8_t *packed = malloc(CODEC_BOUND(cells, sizeof(float)));
+    uint8_t *coded = malloc(ZRLE_BOUND(CODEC_BOUND(cells, sizeof(float))));
+    int ok = field && packed && coded;
+    for (int r = 0; r < nruns; r++) {
+        runs[r].enc_recon = calloc(cells, sizeof(float));
+        runs[r].dec_recon = calloc(cells, sizeof(float));
+        ok = ok && runs[r].enc_recon && runs[r].dec_recon;
+    }
+    if (!ok) {
+        printf("Failed to allocate codec buffers\n");
+        return 1;
+    }
+
+    Uint64 freq = SDL_GetPerformanceFrequency();
+    for (int frame = 0; frame < opts->codec_bench; frame++) {
+        if (opts->storm_enabled) storm_step(&storm, &fluid);
+        update_fluid(&fluid);
+        load_field(&fluid, field);
+
+        for (int r = 0; r < nruns; r++) {
+            CodecRun *run = &runs[r];
+            size_t bytes;
+            Uint64 t0 = SDL_GetPerformanceCounter();
+            if (run->error_bound < 0.0f) {
+                size_t n = series_pack_frame(&q8, field, 0, packed);
+                bytes = zrle_encode(packed, n, coded);
+            } else {
+                if (frame % key_every == 0) memset(run->enc_recon, 0, cells * sizeof(float));
+                bytes = encode_field(field, run->enc_recon, cells, run->error_bound, coded);
+            }
+            Uint64 t1 = SDL_GetPerformanceCounter();
+            if (run->error_bound < 0.0f) {
+                SeriesFrameHeader fh;
+                size_t n = zrle_decode(coded, bytes, packed, CODEC_BOUND(cells, sizeof(float)));
+                memcpy(&fh, packed, sizeof(fh));
+                const int8_t *q = (const int8_t *)(packed + sizeof(fh));
+                for (size_t i = 0; i < cells && n; i++) run->dec_recon[i] = q[i] * fh.scale;
+            } else {
+                if (frame % key_every == 0) memset(run->dec_recon, 0, cells * sizeof(float));
+                if (!decode_field(coded, bytes, run->dec_recon, cells, run->error_bound))
+                    printf("%s: frame %d failed to decode\n", run->name, frame);
+            }
+            Uint64 t2 = SDL_GetPerformanceCounter();
+
+            for (size_t i = 0; i < cells; i++) {
+                double d = fabs((double)run->dec_recon[i] - field[i]);
+                if (d > run->max_err) run->max_err = d;
+            }
+            run->bytes += bytes;
+            run->enc_ticks += t1 - t0;
+            run->dec_ticks += t2 - t1;
+        }
+    }
+
+    int frames = opts->codec_bench > 0 ? opts->codec_bench : 1;
+    double raw_mb = (double)frames * cells * sizeof(float) / (1024.0 * 1024.0);
+    printf("codec bench %dx%d, %d frames, key frame every %d, %.2f MB per raw frame\n",
+           GRID_WIDTH, GRID_HEIGHT, frames, key_every, cells * sizeof(float) / (1024.0 * 1024.0));
+    printf("%-16s %10s %14s %14s %12s\n", "codec", "ratio", "encode MB/s", "decode MB/s", "max error");
+    for (int r = 0; r < nruns; r++) {
+        CodecRun *run = &runs[r];
+        double enc = run->enc_ticks ? (double)run->enc_ticks / freq : 1e-9;
+        double dec = run->dec_ticks ? (double)run->dec_ticks / freq : 1e-9;
+        printf("%-16s %9.1fx %14.1f %14.1f %12.3g\n", run->name,
+               raw_mb * 1024.0 * 1024.0 / (run->bytes > 0 ? run->bytes : 1), raw_mb / enc, raw_mb / dec,
+               run->max_err);
+        free(run->enc_recon);
+        free(run->dec_recon);
+    }
+
+    // lossless checkpoint of the final state, decoded back and compared bit for bit
+    size_t raw_size, packed_size;
+    uint8_t *snapshot = checkpoint_snapshot(&fluid, &raw_size);
+    Uint64 t0 = SDL_GetPerformanceCounter();
+    uint8_t *compressed = snapshot ? checkpoint_compress(snapshot, &packed_size) : NULL;
+    Uint64 t1 = SDL_GetPerformanceCounter();
+    if (compressed) {
+        FluidGrid restored;
+        init_fluid(&restored);
+        int same = decode_checkpoint(&restored, compressed, (const CheckpointHeader *)compressed) &&
+                   memcmp(restored.current, fluid.current, cells * sizeof(cell_t)) == 0 &&
+                   memcmp(restored.previous, fluid.previous, cells * sizeof(cell_t)) == 0;
+        double seconds = t1 > t0 ? (double)(t1 - t0) / freq : 1e-9;
+        printf("checkpoint %s: %.1f MB -> %.1f MB (%.1fx), %.1f MB/s, restore %s\n", CELL_NAME,
+               raw_size / (1024.0 * 1024.0), packed_size / (1024.0 * 1024.0),
+               (double)raw_size / packed_size, raw_size / (1024.0 * 1024.0) / seconds,
+               same ? "exact" : "MISMATCH");
+        free_fluid(&restored);
+    }
+
+    free(snapshot);
+    free(compressed);
+    free(field);
+    free(packed);
+    free(coded);
+    free_fluid(&fluid);
+    return 0;
 }
 
-uint32_t bw_water_color(float height) {
-    
-    float intensity = fabsf(height) * 3.0f;
-    
-    // Foam on wave peaks
-    if (height > 0.2f) {
-        float foam = (height - 0.2f) * 4.0f;
-        intensity -= foam * 0.5f; // Make peaks lighter (foam)
+typedef struct {
+    int fd;
+    StreamHello hello;
+    float *field;               // decoded stream field, the codec's reference
+    uint8_t *buf;
+    size_t buf_bytes;
+    uint64_t step;
+    unsigned long frames;
+} StreamViewer;
+
+int open_viewer(StreamViewer *v, const char *addr) {
+    memset(v, 0, sizeof(*v));
+    v->fd = stream_socket(addr, 0, NULL);
+    if (v->fd < 0) {
+        printf("Failed to connect to %s\n", addr);
+        return 0;
     }
-    
-    intensity = fminf(fmaxf(intensity, 0.0f), 1.0f);
-    
-    uint8_t value = (uint8_t)((1.0f - intensity) * 255);
-    
-    return (0xFF << 24) | (value << 16) | (value << 8) | value;
+    StreamHello *h = &v->hello;
+    if (!recv_all(v->fd, h, sizeof(*h)) || h->magic != STREAM_MAGIC || h->version != STREAM_VERSION ||
+        h->width == 0 || h->height == 0 || (uint64_t)h->width * h->height > ((uint64_t)1 << 32)) {
+        printf("%s is not a realfluid stream\n", addr);
+        return 0;
+    }
+    size_t cells = (size_t)h->width * h->height;
+    v->buf_bytes = CODEC_BOUND(cells, sizeof(float));
+    v->field = calloc(cells, sizeof(float));
+    v->buf = malloc(v->buf_bytes);
+    if (!v->field || !v->buf) {
+        printf("Failed to allocate viewer buffers\n");
+        return 0;
+    }
+    return 1;
 }
 
-void update_fluid_texture(FluidRenderer *frenderer, FluidGrid *fluid, Uint32 time) {
+// blocks for one frame, 0 when the server is gone or sent garbage
+int viewer_receive(StreamViewer *v) {
+    StreamFrameHeader fh;
+    if (!recv_all(v->fd, &fh, sizeof(fh)) || fh.bytes > v->buf_bytes ||
+        !recv_all(v->fd, v->buf, fh.bytes))
+        return 0;
+    if (!decode_field(v->buf, fh.bytes, v->field, (size_t)v->hello.width * v->hello.height, fh.error_bound))
+        return 0;
+    v->step = fh.step;
+    v->frames++;
+    return 1;
+}
+
+static int viewer_readable(const StreamViewer *v, int timeout_ms) {
+    struct pollfd pfd = { v->fd, POLLIN, 0 };
+    return poll(&pfd, 1, timeout_ms) > 0;
+}
+
+void close_viewer(StreamViewer *v) {
+    if (v->fd >= 0) close(v->fd);
+    free(v->field);
+    free(v->buf);
+    memset(v, 0, sizeof(*v));
+}
+
+// nearest upscale of the stream into a local grid, so the normal texture path draws it
+static void viewer_to_grid(const StreamViewer *v, FluidGrid *fluid) {
+    int sw = v->hello.width, sh = v->hello.height;
+    #pragma omp parallel for schedule(static)
     for (int y = 0; y < GRID_HEIGHT; y++) {
-        for (int x = 0; x < GRID_WIDTH; x++) {
-            int idx = y * GRID_WIDTH + x;
-            float height = fluid->current[idx];
-            
-            frenderer->pixels[idx] = water_color(height, x, y, time);  // Color
-        }
+        const float *src = v->field + (size_t)((int64_t)y * sh / GRID_HEIGHT) * sw;
+        cell_t *dst = fluid->current + (size_t)y * GRID_WIDTH;
+        for (int x = 0; x < GRID_WIDTH; x++) dst[x] = CELL_STORE(src[(int64_t)x * sw / GRID_WIDTH]);
     }
 }
 
-void render_fluid(SDL_Renderer *renderer, FluidRenderer *frenderer) {
+// connects to a --serve instance and shows its frames, or prints them with --headless
+int run_view(const FluidOptions *opts) {
+    StreamViewer viewer;
+    if (!open_viewer(&viewer, opts->view_addr)) {
+        close_viewer(&viewer);
+        return 1;
+    }
+    size_t cells = (size_t)viewer.hello.width * viewer.hello.height;
+    printf("viewing %ux%u (1/%u scale) from %s\n", viewer.hello.width, viewer.hello.height,
+           viewer.hello.scale, opts->view_addr);
 
-    SDL_UpdateTexture(frenderer->texture, NULL, frenderer->pixels, frenderer->pitch);
-    
-    // scale texture
-    SDL_RenderCopy(renderer, frenderer->texture, NULL, NULL);
+    if (opts->headless) {
+        while ((opts->frames <= 0 || (int)viewer.frames < opts->frames) && viewer_receive(&viewer)) {
+            double sum2 = 0.0;
+            for (size_t i = 0; i < cells; i++) sum2 += (double)viewer.field[i] * viewer.field[i];
+            printf("frame %6lu  step %8llu  rms %12.6g\n", viewer.frames,
+                   (unsigned long long)viewer.step, sqrt(sum2 / cells));
+        }
+        close_viewer(&viewer);
+        return 0;
+    }
+
+    if (SDL_Init(SDL_INIT_VIDEO) != 0) {
+        printf("SDL_Init Error: %s\n", SDL_GetError());
+        close_viewer(&viewer);
+        return 1;
+    }
+    SDL_Window *window = SDL_CreateWindow("water simm viewer", SDL_WINDOWPOS_CENTERED,
+                                          SDL_WINDOWPOS_CENTERED, WIDTH, HEIGHT, SDL_WINDOW_SHOWN);
+    SDL_Renderer *renderer = window ? SDL_CreateRenderer(window, -1,
+        SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC) : NULL;
+    FluidRenderer frenderer = {0};
+    FluidGrid display;
+    init_fluid(&display);
+    if (!renderer || !init_fluid_renderer(renderer, &frenderer, opts->smooth)) {
+        printf("SDL window Error: %s\n", SDL_GetError());
+        close_viewer(&viewer);
+        return 1;
+    }
+
+    int running = 1;
+    while (running) {
+        SDL_Event event;
+        while (SDL_PollEvent(&event)) {
+            if (event.type == SDL_QUIT ||
+                (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_ESCAPE))
+                running = 0;
+        }
+
+        // drain what has arrived so the picture stays current
+        int fresh = 0;
+        while (running && viewer_readable(&viewer, fresh ? 0 : 16)) {
+            if (!viewer_receive(&viewer)) {
+                printf("stream closed after %lu frames\n", viewer.frames);
+                running = 0;
+            }
+            fresh = 1;
+        }
+        if (fresh) {
+            viewer_to_grid(&viewer, &display);
+            update_fluid_texture(&frenderer, &display, SDL_GetTicks());
+        }
+
+        SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+        SDL_RenderClear(renderer);
+        render_fluid(renderer, &frenderer, 1);
+        SDL_RenderPresent(renderer);
+    }
+
+    close_viewer(&viewer);
+    free_fluid(&display);
+    free_fluid_renderer(&frenderer);
+    SDL_DestroyRenderer(renderer);
+    SDL_DestroyWindow(window);
+    SDL_Quit();
+    return 0;
 }
 
-int main() {
+int main(int argc, char **argv) {
+    FluidOptions opts;
+    if (!parse_options(argc, argv, &opts)) return 1;
+
+    if (opts.series_dump) return dump_series(opts.series_dump);
+    if (opts.codec_bench > 0) return run_codec_bench(&opts);
+    if (opts.stencil_bench > 0) return run_stencil_bench(&opts);
+    if (opts.view_addr) return run_view(&opts);
+    if (opts.ensemble_steps > 0) return run_ensemble(&opts);
+    if (opts.drift_steps > 0) return run_drift(&opts);
+    if (opts.headless) return run_headless(&opts);
+
+
     if (SDL_Init(SDL_INIT_VIDEO) != 0) {
         printf("SDL_Init Error: %s\n", SDL_GetError());
         return 1;
@@ -245,14 +6262,56 @@ int main() {
         return 1;
     }
     
-    FluidGrid fluid;
+    // zeroed so the cleanup below is safe whichever step fails
+    FluidGrid fluid = {0};
     FluidRenderer frenderer = {0};
+    Storm storm;
+    int storm_on = opts.storm_enabled;
     
-    init_fluid(&fluid);
+    CheckpointWriter writer = {0};
+    writer.compress = opts.checkpoint_compress;
+    SeriesWriter series = {0};
+    ProbeSet probes = {0};
+    ObstacleMask obstacles = {0};
+    SpeedMap speed = {0};
+    DampingMap damping_map = {0};
+    FieldStats stats = {0};
+    VideoExporter exporter = {0};
+    FluidShm shm = {0};
+    StreamServer server = {0};
+    int status = 1;
+    
+    if (opts.backing_path) {
+        if (!init_fluid_mapped(&fluid, opts.backing_path)) goto done;
+    } else {
+        init_fluid(&fluid);
+    }
+    damping_from_options(&fluid, &opts);
+    set_boundary(&fluid, opts.boundary, opts.sponge_width, opts.sponge_strength);
+    init_storm(&storm, &opts.storm);
+    place_oscillators(&fluid, opts.oscillators);
+    if (opts.restore_path && !load_checkpoint(&fluid, opts.restore_path)) goto done;
     
-    if (!init_fluid_renderer(renderer, &frenderer)) {
+    if (!open_series_from_options(&series, &opts)) goto done;
+    if (!open_probes_from_options(&probes, &opts)) goto done;
+    if (probes.count > 0) fluid.probes = &probes;
+    if (!open_obstacles_from_options(&obstacles, &opts)) goto done;
+    if (obstacles.solid > 0) attach_obstacles(&fluid, &obstacles);
+    if (!open_speed_from_options(&speed, &opts)) goto done;
+    if (speed.q) fluid.speed = &speed;
+    if (!open_damping_map_from_options(&damping_map, &opts)) goto done;
+    if (damping_map.q) fluid.damping_map = &damping_map;
+    init_stats_from_options(&stats, &opts);
+    if (stats_wanted(&stats, &opts)) fluid.stats = &stats;
+    if (opts.export_path && !open_exporter(&exporter, opts.export_path, opts.export_format,
+                                           opts.export_every, opts.export_fps)) goto done;
+    if (opts.shm_name && !open_shm(&shm, opts.shm_name)) goto done;
+    if (opts.serve_addr && !open_server(&server, opts.serve_addr, opts.serve_scale, opts.serve_error))
+        goto done;
+    
+    if (!init_fluid_renderer(renderer, &frenderer, opts.smooth)) {
         printf("failed to open\n");
-        return 1;
+        goto done;
     }
     
     int running = 1;
@@ -261,7 +6320,11 @@ int main() {
     Uint32 start_time = SDL_GetTicks();
     
     
+    int shown_idle = 0;
+    
     while (running) {
+        // settled and already on screen: sleep until there is input
+        if (fluid.idle && shown_idle && !storm_on) SDL_WaitEventTimeout(NULL, 250);
         Uint32 current_time = SDL_GetTicks() - start_time;
         
         while (SDL_PollEvent(&event)) {
@@ -273,16 +6336,19 @@ int main() {
                 case SDL_MOUSEBUTTONDOWN:
                     if (event.button.button == SDL_BUTTON_LEFT) {
                         mouse_down = 1;
-                        prev_mouse_x = event.button.x / CELL_SIZE;
-                        prev_mouse_y = event.button.y / CELL_SIZE;
+                        prev_mouse_x = GRID_X(event.button.x);
+                        prev_mouse_y = GRID_Y(event.button.y);
                         add_water_drop(&fluid, prev_mouse_x, prev_mouse_y, 20.0f);
+                    } else if (event.button.button == SDL_BUTTON_RIGHT) {
+                        add_oscillator(&fluid, GRID_X(event.button.x),
+                                       GRID_Y(event.button.y), 1.0f, 30.0f);
                     }
                     break;
                     
                 case SDL_MOUSEMOTION:
                     if (mouse_down && (event.motion.state & SDL_BUTTON_LMASK)) {
-                        int current_x = event.motion.x / CELL_SIZE;
-                        int current_y = event.motion.y / CELL_SIZE;
+                        int current_x = GRID_X(event.motion.x);
+                        int current_y = GRID_Y(event.motion.y);
                         
                         if (prev_mouse_x != -1 && prev_mouse_y != -1) {
                             add_continuous_wave(&fluid, 
@@ -309,8 +6375,45 @@ int main() {
                             rand() % (GRID_WIDTH - 6) + 3, 
                             rand() % (GRID_HEIGHT - 6) + 3, 25.0f);
                     } else if (event.key.keysym.sym == SDLK_r) {
-                        free_fluid(&fluid);
-                        init_fluid(&fluid);
+                        // a --backing grid stays in its file
+                        reset_fluid(&fluid);
+                    } else if (event.key.keysym.sym == SDLK_b) {
+                        Boundary *b = &fluid.boundary;
+                        int mode = (b->mode + 1) % BOUNDARY_MODES;
+                        if (!boundary_supported(mode)) mode = (mode + 1) % BOUNDARY_MODES;
+                        set_boundary(&fluid, mode, b->width, b->strength);
+                        printf("boundary: %s\n", boundary_names[b->mode]);
+                    } else if (event.key.keysym.sym == SDLK_m) {
+                        fluid.damping_model = (fluid.damping_model + 1) % DAMPING_MODELS;
+                        printf("damping model: %s\n", damping_model_names[fluid.damping_model]);
+                    } else if (event.key.keysym.sym == SDLK_EQUALS || event.key.keysym.sym == SDLK_PLUS ||
+                               event.key.keysym.sym == SDLK_KP_PLUS) {
+                        // halve the loss per step, down to none
+                        fluid.damping = 1.0f - (1.0f - fluid.damping) * 0.5f;
+                        if (fluid.damping > 0.99999f) fluid.damping = 1.0f;
+                        printf("damping %g\n", fluid.damping);
+                    } else if (event.key.keysym.sym == SDLK_MINUS || event.key.keysym.sym == SDLK_KP_MINUS) {
+                        // double it, starting from a small loss when there is none
+                        fluid.damping = fluid.damping >= 1.0f ? 0.9999f : 1.0f - (1.0f - fluid.damping) * 2.0f;
+                        if (fluid.damping < 0.5f) fluid.damping = 0.5f;
+                        printf("damping %g\n", fluid.damping);
+                    } else if (event.key.keysym.sym == SDLK_t) {
+                        // toggle storm
+                        storm_on = !storm_on;
+                    } else if (event.key.keysym.sym == SDLK_p) {
+                        // paddle along the left edge
+                        add_paddle(&fluid, 3, 3, 3, GRID_HEIGHT - 4, 0.5f, 40.0f);
+                    } else if (event.key.keysym.sym == SDLK_d) {
+                        int mx, my;
+                        SDL_GetMouseState(&mx, &my);
+                        add_drain(&fluid, GRID_X(mx), GRID_Y(my), 8, 0.2f);
+                    } else if (event.key.keysym.sym == SDLK_c) {
+                        clear_emitters(&fluid);
+                    } else if (event.key.keysym.sym == SDLK_k) {
+                        save_checkpoint_async(&writer, &fluid, opts.checkpoint_path);
+                    } else if (event.key.keysym.sym == SDLK_l) {
+                        checkpoint_wait(&writer);
+                        load_checkpoint(&fluid, opts.checkpoint_path);
                     } else if (event.key.keysym.sym == SDLK_ESCAPE) {
                         running = 0;
                     }
@@ -318,29 +6421,61 @@ int main() {
             }
         }
         
+        if (storm_on) storm_step(&storm, &fluid);
+        
         // Update physics
+        uint64_t before = fluid.step;
         update_fluid(&fluid);
         
+        // a settled grid keeps its last texture, nothing is stepped, colorized or uploaded
+        if (fluid.step != before) {
+            if (opts.stats_every > 0 && fluid.step % opts.stats_every == 0) print_stats(&stats);
+            if (opts.checkpoint_every > 0 && fluid.step % opts.checkpoint_every == 0)
+                save_checkpoint_async(&writer, &fluid, opts.checkpoint_path);
+            series_push(&series, &fluid);
+            shm_publish(&shm, &fluid);
+            stream_publish(&server, &fluid);
+            shown_idle = 0;
+        }
+        
         // Update rendering
-        update_fluid_texture(&frenderer, &fluid, current_time);
+        int upload = !shown_idle;
+        if (upload) {
+            update_fluid_texture_dirty(&frenderer, &fluid, current_time);
+            export_push(&exporter, &frenderer, fluid.step);
+            shown_idle = fluid.idle;
+        }
         
         // Clear and render
         SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
         SDL_RenderClear(renderer);
         
-        render_fluid(renderer, &frenderer);
+        render_fluid(renderer, &frenderer, upload);
         
         SDL_RenderPresent(renderer);
         
         // Cap at 60 FPS
         SDL_Delay(16);
     }
+    status = 0;
     
+    // every exit past the window goes through here, a failed start writes no probe file
+done:
+    checkpoint_wait(&writer);
+    close_series(&series);
+    close_exporter(&exporter);
+    close_shm(&shm);
+    close_server(&server);
+    if (status == 0) close_probes(&probes, opts.probe_out);
+    else free_probes(&probes);
+    free_obstacles(&obstacles);
+    free_speed(&speed);
+    free_damping_map(&damping_map);
     free_fluid(&fluid);
     free_fluid_renderer(&frenderer);
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
     SDL_Quit();
     
-    return 0;
+    return status;
 }
\ No newline at end of file